@@ -18,7 +18,4 @@ void play_sound();
 void stop_sound();
 
 void set_sound_frequency(uint8_t frequency);
-void set_sound_duration(uint8_t duration);
-
-extern volatile bool sound_finished;
 
@@ -0,0 +1,56 @@
+/*
+    System clock for the ATmega328P and ATtiny85.
+    A periodic tick keeps the time in milliseconds
+    and wakes the CPU from idle sleep. On top of it sit timeouts for polling and
+    a timer wheel for callbacks.
+*/
+
+#pragma once
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#if defined(__AVR_ATtiny85__)
+    // Timer0 and Timer1 both belong to the buzzer, so the watchdog ticks (nominally 16 ms, ±10 % over voltage and temperature)
+    #define CLOCK_TICK_MS 16
+#elif defined(__AVR_ATmega328P__)
+    // Timer1 is free, Timer0 and Timer2 belong to the buzzer
+    #define CLOCK_TICK_MS 1
+#endif
+
+// Slots in the timer wheel, a power of two. Timers further out than a turn of the wheel wait out the extra turns in their slot.
+#define TIMER_WHEEL_SLOTS 8
+
+
+/*  A callback to be run once after a delay, from timer_service() in the main loop.
+    Belongs to the caller, who must keep it alive while it is armed. */
+typedef struct Timer {
+    struct Timer *next;
+    uint32_t expires;
+    void (*callback)(struct Timer *timer);
+    bool armed;
+} Timer;
+
+
+/* Starts the tick interrupt. */
+void clock_init(void);
+/*  Milliseconds since clock_init(), in steps of CLOCK_TICK_MS. Wraps around after ~49 days.
+    Only moves while interrupts are on. */
+uint32_t now_ms(void);
+
+/* A deadline at least ms milliseconds from now, for timeout_expired() */
+uint32_t timeout_in(uint32_t ms);
+/* True once the deadline from timeout_in() has passed */
+bool timeout_expired(uint32_t deadline);
+
+/* Arms the timer to run callback in at least delay_ms milliseconds, rearming it if it already was. */
+void timer_start(Timer *timer, uint32_t delay_ms, void (*callback)(Timer *timer));
+/* Disarms the timer, if it is armed. */
+void timer_stop(Timer *timer);
+/* True when some timer's slot has come around and timer_service() has something to look at. */
+bool timer_due(void);
+/* Runs the callbacks of the timers that have expired. Callbacks may arm and stop timers, including their own. */
+void timer_service(void);
@@ -0,0 +1,17 @@
+/*
+    CRC-32 (IEEE 802.3, as in the Ethernet frame check sequence), a nibble at a time from a table in progmem.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+
+// The starting value, and what the final value gets XOR'd with
+#define CRC32_INIT 0xFFFFFFFFul
+
+
+/*  Folds a byte into the running CRC, started from CRC32_INIT.
+    The finished CRC is the complement of the running one, sent least significant byte first. */
+uint32_t crc32_update(uint32_t crc, uint8_t byte);
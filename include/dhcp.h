@@ -5,6 +5,7 @@
 #pragma once
 
 #include "socket.h"
+#include "clock.h"
 #include <stdlib.h>
 #include "string.h"
 
@@ -14,10 +15,14 @@
 #define IPv4_H_LEN 20u
 #define UDP_H_LEN 8u
 #define MACRAW_H_LEN (ETH_H_LEN + IPv4_H_LEN + UDP_H_LEN)
+// The sender's IP and port and the message length, put in front of every message received in UDP mode
+#define UDP_INFO_LEN 8u
 #define DHCP_H_START_LEN 34u
 #define DHCP_H_ZEROES 202u
 #define DISCOVER_OPTIONS_LEN 16u
 #define REQUEST_OPTIONS_LEN 26u
+#define RENEW_OPTIONS_LEN 13u
+#define REBOOT_OPTIONS_LEN 19u
 #define DHCP_MESSAGE_LEN (DHCP_H_START_LEN + DHCP_H_ZEROES + DISCOVER_OPTIONS_LEN)
 #define UDP_TOTAL_LEN (DHCP_MESSAGE_LEN + UDP_H_LEN)
 #define IPv4_TOTAL_LEN (UDP_TOTAL_LEN + IPv4_H_LEN)
@@ -58,9 +63,12 @@
 #define HTYPE 0x01
 #define HLEN 0x06
 #define HOPS 0x00
-#define FLAGS 0x00, 0x00
-// An identifier of a given message chain, preferably randomised
-#define XID 0x23, 0x87, 0x13, 0x65
+#ifdef DHCP_UDP
+    // The broadcast flag: in UDP mode the W5500 drops replies sent to an address it doesn't have yet
+    #define FLAGS 0x80, 0x00
+#else
+    #define FLAGS 0x00, 0x00
+#endif
 
 /* Options */
 #define MAGIC_COOKIE 0x63, 0x82, 0x53, 0x63
@@ -71,6 +79,11 @@
 #define ACQUIRED 0x11
 #define FRESH_ACQUIRED 0x21
 #define EXPIRED 0x31
+// Extending the lease past T1 with the server that gave it, and past T2 with any server
+#define RENEWING 0x13
+#define REBINDING 0x23
+// Asking to keep the lease saved in EEPROM from before the reboot (INIT-REBOOT)
+#define REBOOTING 0x33
 #define OFFER 0x02
 #define REQUEST 0x03
 #define DECLINE 0x04
@@ -85,28 +98,54 @@
 // End of options (and message)
 #define END 0xFF, 0x00
 
+/* Codes of the options read from replies, which can come in any order */
+#define OPTION_PAD 0x00
+#define OPTION_SUBNET 0x01
+#define OPTION_ROUTER 0x03
+#define OPTION_LEASE 0x33
+#define OPTION_MESSAGE_TYPE 0x35
+#define OPTION_SERVER 0x36
+#define OPTION_T1 0x3A
+#define OPTION_T2 0x3B
+#define OPTION_END 0xFF
+
 /* Offsets for different sections in header checksum calculations, from link layer/ethernet header start */
 #define IPv4_LENGTH_STEP 2
 #define IPv4_CHECKSUM_STEP 10
 #define UDP_LENGTH_STEP 24
 /* Offsets for different DHCP packet sections from link layer header start*/
-#define UDP_SOURCE_STEP 26
+#define ETH_SOURCE_STEP 6
+#define DHCP_H_START_STEP 42
+#define XID_STEP 46
+#define CIADDR_STEP 54
 #define YIADDR_STEP 58
 #define YIADDR_TO_SIADDR_STEP 4
 #define SIADDR_STEP 62
 #define SIADDR_TO_ZEROES_STEP 24
+#define DHCP_H_ZEROES_STEP 76
 #define CHADDR_STEP 70
-#define CHADDR_TO_COOKIE_STEP 208
 #define MAGIC_COOKIE_STEP 278
 #define REQUESTED_IP_STEP 287
-#define COOKIE_TO_MTYPE_STEP 6
+// Where our server identifier goes in request_options
 #define COOKIE_TO_SERVER_STEP 15
-#define COOKIE_TO_SUBNET_STEP 21
-#define COOKIE_TO_GATEWAY_STEP 27
-#define COOKIE_TO_LEASE_STEP 15
 
-// For the DHCP tracker; how many iterations of the loop until a request is repeated
-#define MESSAGE_DELAY 200000ul
+// Milliseconds between calls to dhcp_tracker() from the main loop
+#define DHCP_TRACKER_MS 100u
+/* Repeating unanswered messages, as in RFC 2131 (4.1): after 4 s, doubling up to 64 s, each wait give or take up to a second */
+#define RETRY_BASE_MS 4000ul
+#define RETRY_DOUBLINGS 4
+#define RETRY_MAX_MS (RETRY_BASE_MS << RETRY_DOUBLINGS)
+#define RETRY_JITTER_MS 1000ul
+// Requests for an offer that go unanswered this many times send the client back to discovering
+#define REQUEST_RETRIES 3
+// The most a discover is held back when (re)starting, so that devices booting together don't all send at once
+#define DISCOVER_JITTER_MS 1000ul
+// The lease length assumed when the server doesn't give one (1 h), in seconds
+#define DEFAULT_LEASE_S 3600ul
+// Longer leases are cut down to this (about 23 days), as deadlines have to stay within 2^31 ms of the clock
+#define LEASE_MAX_S 2000000ul
+// The shortest wait between repeated requests while renewing or rebinding
+#define RENEW_RETRY_MIN_MS 60000ul
 
 
 /*  Holds data related to lease negotiations.
@@ -114,11 +153,29 @@
 typedef struct {
     // The phase of a DHCP negotiation we're in
     uint8_t dhcp_status;
-    // The time since our last request
-    uint32_t dhcp_lease_time;
+    // The phase the last message was sent in, and how many times in a row it has been sent
+    uint8_t sent_status;
+    uint8_t retries;
+    // Transaction ID for our messages and the replies to them, new for every start of the client
+    uint8_t xid[4];
+    // When the tracker next has to act (a deadline from timeout_in): repeat our last message, or renew the lease (T1)
+    uint32_t dhcp_timeout;
+    // When renewing gives way to rebinding (T2)
+    uint32_t rebind_timeout;
+    // When the lease runs out
+    uint32_t lease_expiry;
     uint8_t server[4];
     uint8_t our_ip[4];
     uint8_t submask[4];
+    uint8_t router[4];
+    #ifndef DHCP_UDP
+        // Where the server's ACK came from on the link, for unicasting renewals (the W5500 looks it up itself in UDP mode)
+        uint8_t server_mac[6];
+    #endif
+    // The lease, renewal (T1) and rebinding (T2) times from the server's ACK in seconds, 0 where it gave none
+    uint32_t lease_time;
+    uint32_t t1_time;
+    uint32_t t2_time;
 } DHCP_Client;
 
 /* A single instance of DHCP Client for our use. */
@@ -0,0 +1,18 @@
+/*
+    Randomness for chips without a generator of their own: the noise in the lowest bits
+    of the ADC's readings of the internal temperature sensor.
+*/
+
+#pragma once
+
+#include <avr/io.h>
+#include <stdint.h>
+
+
+// ADC conversions folded in by entropy_gather()
+#define ENTROPY_SAMPLES 32
+
+
+/*  Folds ENTROPY_SAMPLES readings of the temperature sensor into the running CRC-32 (see crc32.h) and returns it.
+    Takes about 7 ms and leaves the ADC switched off. */
+uint32_t entropy_gather(uint32_t crc);
@@ -0,0 +1,61 @@
+/*
+    A cooperative scheduler for the main loop.
+    Tasks sit in a static table in order of priority, the first one being the most urgent.
+    A task is due when its period comes around or when it has work pending (such as an interrupt event),
+    and each pass runs the most urgent due task only, so a long burst of one kind of work
+    can't hold up the ones above it.
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "clock.h"
+
+
+/*  One entry of a task table, set up with TASK() in program memory, as it never changes.
+    The scheduler keeps what does change in a Task_State of its own for each entry. */
+typedef struct {
+    void (*run)(void);
+    // Whether the task has work waiting regardless of its period (may be nullptr)
+    bool (*pending)(void);
+    // Milliseconds between runs, 0 to only run when pending
+    uint16_t period_ms;
+    // How long a task may wait once due before its run counts as missed (with SCHED_STATS)
+    uint16_t deadline_ms;
+} Task;
+
+/*  The scheduler's bookkeeping for a task, in RAM, zeroed to start with.
+    Times are from now_ms(), so on the ATtiny85 they move in steps of 16 ms: single runs mostly
+    measure as 0 or 16 ms, but the totals over many runs are fair estimates. */
+typedef struct {
+    // When the next periodic run is due
+    uint32_t next;
+    bool waiting;
+
+    #ifdef SCHED_STATS
+        // When the task became due, if it is waiting to run
+        uint32_t released;
+        // Run-time statistics
+        uint16_t runs;
+        uint16_t missed;
+        uint16_t max_run_ms;
+        uint32_t total_run_ms;
+    #endif
+} Task_State;
+
+// A task table entry
+#define TASK(run_fn, pending_fn, period, deadline) \
+    {.run = (run_fn), .pending = (pending_fn), .period_ms = (period), .deadline_ms = (deadline)}
+
+
+/*  Runs the most urgent due task in the table (in program memory), if any.
+    Returns false if nothing was due, so the caller can sleep until the next interrupt. */
+bool sched_run(const Task *tasks, Task_State *states, uint8_t task_count);
+
+#ifdef SCHED_STATS
+/* Prints (and resets) the run counts, run times and missed deadlines of every task in the table over UART */
+void print_sched_stats(Task_State *states, uint8_t task_count);
+#endif
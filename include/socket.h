@@ -33,9 +33,17 @@
 #define TCP_MODE 0x01
 // 4 for broadcast blocking
 #define UDP_MODE 0x42
+#define UDP_BROADCAST_MODE 0x02
 // 8 to set the "only receive broadcasts and addresses packets"
 #define MACRAW_MODE 0x84
 
+// Flags for the registers shadowed in the Socket struct
+#define SHADOW_MR 0x01
+#define SHADOW_PORT 0x02
+#define SHADOW_IMR 0x04
+// The destination registers (S_DHAR, S_DIPR, S_DPORT), tracked by whoever owns the socket
+#define SHADOW_DEST 0x08
+
 // Macros for things too small to be a function yet too weird to read
 #define SOCKETMASK(sockno) \
     (sockno << 5)
@@ -55,27 +63,26 @@ typedef struct {
     /* The TX write pointer only gets incremented with SEND operations, so we
     need to track it manually for compound write operations */
     uint16_t tx_pointer;
+    // The interrupt mask as written to S_IMR (TCP sockets always get CON_INT as well)
+    uint8_t imr;
+    /*  Write-through shadowing: mode, portno and imr mirror the W5500's registers for every SHADOW_ flag set here,
+    so writes of an unchanged value are skipped. A cleared flag marks a dirty shadow, forcing the next write out. */
+    uint8_t shadowed;
 } Socket;
 
-// Global address manipulation
-#define embed_socket(sockno) \
-    wizchip_address[2] = (wizchip_address[2] & 0x1F) | (sockno << 5)
-#define set_half_address(byte_two) \
-    wizchip_address[1] = byte_two
-void embed_pointer(uint16_t pointer);
-void set_address(uint8_t byte_one, uint8_t byte_two, uint8_t block);
-
 /* Attaches port number, interrupt mask and mode of operation to socket */
 void socket_initialise(Socket *socket, uint8_t mode, uint16_t portno, uint8_t interrupt_mask);
 /* Opens socket, updates struct's tx write pointer to match the current read pointer as that gets initialised with socket opens */
 void socket_open(Socket *socket);
 /* Self-explanatory. */
-void socket_close(const Socket *socket);
+void socket_close(Socket *socket);
 /* Reads the socket's status register into the socket struct */
 void socket_get_status(Socket *socket);
 /*  Toggles a socket's interrupts on or off based on the socket's interrupt mask.
     Will always include a CON_INT for TCP sockets for pointer tracking purposes, even if not requested by user. */
-void socket_toggle_interrupts(const Socket *socket, bool set_on);
+void socket_toggle_interrupts(Socket *socket, bool set_on);
+/* Clears the W5500's socket interrupt mask register, disabling interrupts from every socket */
+void socket_clear_interrupt_mask(void);
 /*  */
 void socket_update_read_pointer(const Socket *socket, uint16_t read_pointer);
 /* Updates the socket's TX write pointer register and commands the W5500 to transmit the contents of socket TX buffer. */
@@ -1,5 +1,6 @@
 /*
-    Module for bit-banged SPI communication between a W5500 and AVR ATtiny85 (or ATmega328P)
+    Module for SPI communication between a W5500 and AVR ATtiny85 (or ATmega328P),
+    bit-banged or over the device's SPI hardware (see SPI_HARDWARE below)
 */
 
 #pragma once
@@ -12,10 +13,36 @@
 
 
 // Device-specific pin assignments
-#if defined(__AVR_ATtiny85__)
+// Defining SPI_HARDWARE (e.g. DEFINES = SPI_HARDWARE in make.conf) swaps the bit-banged
+// transport for the device's own SPI hardware, which requires its own wiring below.
+#if defined(__AVR_ATtiny85__) && defined(SPI_HARDWARE)
+    // Transfers go through the USI in three-wire mode
+    #define SPI_USI
+    // External interrupt, INT0 shares PB2 with USCK so a pin change interrupt is used instead
+    #define INT_ENABLE GIMSK
+    #define INT_BIT PCIE
+    #define INT_PIN_CHANGE
+    #define W5500_INT_vect PCINT0_vect
+    // SPI clock (USCK)
+    #define CLK PB2
+    // SPI chip select
+    #define SEL PB4
+    // SPI master out (DO)
+    #define MO PB1
+    // SPI master in (DI)
+    #define MI PB0
+    // W5500 interrupt signal
+    #define INTR PB3
+    #define INTREG DDRB
+    #define INTPIN PINB
+    // Pins held high between transmissions, DO doubles as the UART output
+    #define IDLE_HIGH (_BV(SEL) | _BV(MO))
+#elif defined(__AVR_ATtiny85__)
     // External interrupt
     #define INT_MODE MCUCR
     #define INT_ENABLE GIMSK
+    #define INT_BIT INT0
+    #define W5500_INT_vect INT0_vect
     // SPI clock
     #define CLK PB1
     // SPI chip select
@@ -27,9 +54,35 @@
     // W5500 interrupt signal
     #define INTR PB2
     #define INTREG DDRB
+    #define INTPIN PINB
+    // Pins held high between transmissions, the clock doubles as the UART output
+    #define IDLE_HIGH (_BV(SEL) | _BV(CLK))
+#elif defined(__AVR_ATmega328P__) && defined(SPI_HARDWARE)
+    // Transfers go through the SPI peripheral at F_CPU / 2
+    #define SPI_PERIPHERAL
+    #define INT_MODE EICRA
+    #define INT_ENABLE EIMSK
+    #define INT_BIT INT0
+    #define W5500_INT_vect INT0_vect
+    // SPI clock (SCK)
+    #define CLK PB5
+    // SPI chip select (SS, has to be an output for the peripheral to stay in master mode)
+    #define SEL PB2
+    // SPI master out (MOSI)
+    #define MO PB3
+    // SPI master in (MISO)
+    #define MI PB4
+    // W5500 interrupt signal
+    #define INTR PD2
+    #define INTREG DDRD
+    #define INTPIN PIND
+    // Pins held high between transmissions
+    #define IDLE_HIGH _BV(SEL)
 #elif defined(__AVR_ATmega328P__)
     #define INT_MODE EICRA
     #define INT_ENABLE EIMSK
+    #define INT_BIT INT0
+    #define W5500_INT_vect INT0_vect
     // SPI clock
     #define CLK PB0
     // SPI chip select
@@ -41,12 +94,17 @@
     // W5500 interrupt signal
     #define INTR PD2
     #define INTREG DDRD
+    #define INTPIN PIND
+    // Pins held high between transmissions
+    #define IDLE_HIGH (_BV(SEL) | _BV(CLK))
 #else
     #error "Not a supported microcontroller"
     // These are only here to stop the red squiggly lines from undefined macros
     // External interrupt
     #define INT_MODE MCUCR
     #define INT_ENABLE GIMSK
+    #define INT_BIT INT0
+    #define W5500_INT_vect INT0_vect
     // SPI clock
     #define CLK PB1
     // SPI chip select
@@ -58,12 +116,16 @@
     // W5500 interrupt signal
     #define INTR PB2
     #define INTREG DDRB
+    #define INTPIN PINB
+    #define IDLE_HIGH (_BV(SEL) | _BV(CLK))
 #endif
 
 #define EXTRACTBIT(byte, index) ((byte & (1 << index)) >> index)
-// Turns off the INT0 interrupt to prevent a write or read operation from getting interrupted
-#define ENABLEINT0 (INT_ENABLE |= (1 << INT0))
-#define DISABLEINT0 (INT_ENABLE &= (INT_ENABLE & ~(1 << INT0)))
+// Masks the W5500 interrupt (INT0 or the pin change interrupt) while its registers wait to be swept, see wizchip_service()
+#define ENABLEINT0 (INT_ENABLE |= (1 << INT_BIT))
+#define DISABLEINT0 (INT_ENABLE &= (INT_ENABLE & ~(1 << INT_BIT)))
+// The W5500 holds its interrupt line low for as long as it has interrupts pending
+#define INT_ASSERTED (!(INTPIN & _BV(INTR)))
 
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
@@ -81,23 +143,120 @@
 #define ASSIGN(list, i, element, args...) \
     EVAL(LOOP(list, i, element, args))
 
-extern uint8_t wizchip_address[3];
+/*  A W5500 address, passed by value so that no transaction depends on another's state:
+    the 16-bit offset and the control byte of the header (block, socket number and R/W bit) */
+typedef struct {
+    uint16_t pointer;
+    uint8_t control;
+} Wiz_Address;
+
+// Address builders for the comma lists in w5500_addresses.h, e.g. ADDRESS(SIMR) or SOCKET_ADDRESS(S_CR, sockno)
+#define ADDRESS(...) _ADDRESS(__VA_ARGS__)
+#define _ADDRESS(byte_one, byte_two, block) \
+    ((Wiz_Address){.pointer = ((uint16_t)(byte_one) << 8) | (byte_two), .control = (block)})
+#define SOCKET_ADDRESS(...) _SOCKET_ADDRESS(__VA_ARGS__)
+#define _SOCKET_ADDRESS(byte_one, byte_two, block, sockno) \
+    ((Wiz_Address){.pointer = ((uint16_t)(byte_one) << 8) | (byte_two), .control = ((block) & 0x1F) | ((sockno) << 5)})
+// A place in a socket's TX or RX buffer (S_TX_BUF_BLOCK or S_RX_BUF_BLOCK)
+#define BUFFER_ADDRESS(buffer_pointer, block, sockno) \
+    ((Wiz_Address){.pointer = (buffer_pointer), .control = ((block) & 0x1F) | ((sockno) << 5)})
+// The same address moved on by offset bytes
+#define ADDRESS_OFFSET(address, offset) \
+    ((Wiz_Address){.pointer = (address).pointer + (offset), .control = (address).control})
+
+/*  Bytes moved per slice of a transaction. Between slices any pending interrupts get to run,
+    and if one of them used the bus, the transaction sends its header again and carries on. */
+#define SPI_SLICE_LEN 16
+
+// The most bytes gathered before each call to a read_stream() sink
+#define STREAM_BLOCK_LEN 8
+
+/*  Consumer of read_stream() data, called with blocks of up to STREAM_BLOCK_LEN bytes.
+    Runs in the middle of the transmission, so it must not touch the SPI bus itself, nor its pins:
+    that includes the bit-banged UART on the ATtiny85, whose TX pin is the SPI clock. */
+typedef void (*Stream_Sink)(const uint8_t *block, uint8_t block_len);
+
+#ifdef SPI_STATS
+/* Bus usage counters, enabled with SPI_STATS and printed (and reset) with print_spi_stats() */
+typedef struct {
+    // Transactions put on the bus
+    uint16_t transactions;
+    // Transactions skipped as the register shadows already matched
+    uint16_t saved;
+    // read_snapshot() calls and the transactions they took
+    uint16_t snapshots;
+    uint16_t snapshot_transactions;
+    // W5500 interrupts serviced and the socket events they brought in (see INT_WAIT_US)
+    uint16_t int_assertions;
+    uint16_t int_events;
+} SPI_Counters;
+extern SPI_Counters SPI_Stats;
+#define STAT_ADD(counter, amount) (SPI_Stats.counter += (amount))
+/* Prints the counters since the last print over UART under the given progmem label, then resets them */
+void print_spi_stats(const char *label);
+#else
+#define STAT_ADD(counter, amount)
+#endif
+
+// Segment sources for write_segments()
+#define SEGMENT_RAM 0
+#define SEGMENT_PROGMEM 1
+#define SEGMENT_FILL 2
+
+/* A piece of a write_segments() transaction */
+typedef struct {
+    // Offset from the address given to write_segments()
+    uint16_t offset;
+    uint16_t len;
+    // SEGMENT_RAM, SEGMENT_PROGMEM or SEGMENT_FILL
+    uint8_t source;
+    // The array to write, or the byte to repeat for SEGMENT_FILL
+    union {
+        const uint8_t *data;
+        uint8_t fill;
+    };
+} Segment;
+
+// The most adjacent 2-byte registers a single read_snapshot() can take (e.g. S_TX_FSR through S_RX_RD)
+#define SNAPSHOT_MAX_REGISTERS 5
+// How many times a changing register is re-read before read_snapshot() settles for its latest value
+#define SNAPSHOT_RETRIES 4
 
 /*  Reads a 2-byte register value repeatedly until the value matches on two consecutive reads.
     As a 2-byte value has to be read in two pieces, there is a possibility of the value changing mid-read.
     Returns the read value. */
-uint16_t get_2_byte();
+uint16_t get_2_byte(Wiz_Address address);
+/*  Reads count adjacent 2-byte registers from address into values, in one burst confirmed by a second one.
+    Only the registers that changed between the two get re-read, on their own, until two consecutive reads match
+    or SNAPSHOT_RETRIES runs out. Returns the number of transactions it took. */
+uint8_t read_snapshot(Wiz_Address address, uint16_t *values, uint8_t count);
 /* Initializes the pins needed for SPI transmissions */
 void spi_init();
+/*  Claims the SPI bus for a batch of transactions: buzzer paused and pins set up, just once.
+    Transactions inside a session only toggle chip select. Sessions nest, the outermost bus_end() releases the bus.
+    Interrupts stay on, transactions only hold them off around chip select edges and a slice at a time. */
+void bus_begin(void);
+/* Ends a session started with bus_begin(), restoring the buzzer once the outermost one ends */
+void bus_end(void);
 
 /*  Reads data from a given address into to given buffer.
     Returns 0 on full read, difference between buffer length and read length if buffer space is insufficient to hold the whole message. */
-void read(uint8_t *buffer, uint8_t buffer_len, uint8_t read_len);
-void read_reversed(uint8_t *buffer, uint8_t buffer_len, uint8_t read_len);
+void read(Wiz_Address address, uint8_t *buffer, uint8_t buffer_len, uint8_t read_len);
+void read_reversed(Wiz_Address address, uint8_t *buffer, uint8_t buffer_len, uint8_t read_len);
+/*  Reads read_len bytes from a given address in a single transmission, handing them to sink as they come in.
+    Any length up to a whole 16-bit buffer window can be read without staging it in RAM. */
+void read_stream(Wiz_Address address, uint16_t read_len, Stream_Sink sink);
 
 /* Writes an array to the W5500's registers. */
-void write(uint16_t data_len, const uint8_t *data);
+void write(Wiz_Address address, uint16_t data_len, const uint8_t *data);
 /* Writes an array stored in progmem to the W5500's registers. */
-void write_P(uint16_t data_len, const uint8_t *data);
+void write_P(Wiz_Address address, uint16_t data_len, const uint8_t *data);
 /* Writes a single byte repeatedly to the W5500's registers. */
-void write_singular(uint16_t data_len, uint8_t data);
\ No newline at end of file
+void write_singular(Wiz_Address address, uint16_t data_len, uint8_t data);
+/*  Writes a list of segments relative to address, in order.
+    Each segment that starts where the previous one ended continues the same burst,
+    a gap ends the burst and starts a new one at the segment's offset. */
+void write_segments(Wiz_Address address, uint8_t segment_count, const Segment *segments);
+/*  Like write_segments(), also folding every byte written into the running CRC-32 at crc (see crc32.h)
+    as it goes out. Bytes in the gaps between segments aren't written, so they aren't folded in either. */
+void write_segments_crc(Wiz_Address address, uint8_t segment_count, const Segment *segments, uint32_t *crc);
\ No newline at end of file
@@ -5,6 +5,8 @@
 #pragma once
 
 #include "socket.h"
+#include "transfer.h"
+#include "clock.h"
 
 
 // TCP status codes
@@ -22,24 +24,43 @@
 // Different bits in the tcp_send operand.
 #define OP_PROGMEM 0x01
 #define OP_HOLDBACK 0x02
+#define OP_BACKGROUND 0x04
+#define OP_DISCONNECT 0x08
 
-extern Socket TCP_Socket;
+// Number of TCP sockets in the pool, each serving one client at a time (max. 7 as one is taken by the DHCP client).
+// Every socket costs ~25 bytes of RAM, hence the modest default for the ATtiny85.
+#define USER_SOCKETNO 4
+// The first W5500 socket used by the pool, the ones before it belong to the DHCP client
+#define TCP_FIRST_SOCKET 1
+// How long tcp_listen() waits for the socket to take each step before giving up
+#define TCP_STATUS_TIMEOUT_MS 20
+
+// The TCP socket pool, TCP_Sockets[i] is W5500 socket TCP_FIRST_SOCKET + i
+extern Socket TCP_Sockets[USER_SOCKETNO];
 
 /* Basic setup to get the socket ready for operation. */
-void tcp_socket_initialise(uint16_t portno, uint8_t interrupts);
+void tcp_socket_initialise(Socket *socket, uint16_t portno, uint8_t interrupts);
 /*  Puts the socket into TCP listen mode. 
     If the socket setup doesn't proceed as expected, returns the status code of the socket. */ 
-uint8_t tcp_listen();
+uint8_t tcp_listen(Socket *socket);
 /*  Writes a message to the socket's TX buffer and sends in the "send" command.
     Operands: 
     - OP_PROGMEM if you're sending in a pointer to an array in program memory rather than a normal array 
-    - OP_HOLDBACK if you want to delay sending the message and write more into the buffer */
-uint8_t tcp_send(uint16_t message_len, const char *message, uint8_t operands);
+    - OP_HOLDBACK if you want to delay sending the message and write more into the buffer
+    - OP_BACKGROUND to hand the write to the transfer queue and return straight away, the send
+    command goes out once the last byte is written. The message must stay put until then.
+    - OP_DISCONNECT to disconnect once the message has been sent
+    Returns 1 if the buffer doesn't have room, 2 if the socket's last background send is still under way
+    or the transfer queue is full. */
+uint8_t tcp_send(Socket *socket, uint16_t message_len, const char *message, uint8_t operands);
 /*  Reads the socket's RX buffer into a given buffer
     - As the only goal for our server is to get the path from a message, the message is 
     marked as entirely received even when only a small amount is in fact read */
-void tcp_read_received(uint8_t *buffer, uint8_t buffer_len);
+void tcp_read_received(Socket *socket, uint8_t *buffer, uint8_t buffer_len);
+/*  Streams everything in the socket's RX buffer to sink in one transmission, then marks it as read.
+    Returns the number of bytes streamed. */
+uint16_t tcp_stream_received(Socket *socket, Stream_Sink sink);
 /* Sends a disconnect command to the socket, which will start a connection close process. */
-void tcp_disconnect();
+void tcp_disconnect(Socket *socket);
 /* Closes the socket. */
-void tcp_close();
\ No newline at end of file
+void tcp_close(Socket *socket);
\ No newline at end of file
@@ -0,0 +1,42 @@
+/*
+    Background transfer queue for the W5500.
+    Queued writes are moved to the W5500 a slice at a time whenever the main loop calls transfer_service,
+    so long writes don't hold the bus for their whole length, and never from an interrupt.
+*/
+
+#pragma once
+
+#include "spi.h"
+
+
+// Bytes written per slice
+#define TRANSFER_SLICE_LEN 32
+// How many transfers can wait in the queue, a power of two (enough for a background send from every TCP socket)
+#define TRANSFER_QUEUE_LEN 8
+
+/*  A single queued write. Belongs to the caller, who must keep it alive until done is set.
+    - address: W5500 address the data starts at
+    - source: SEGMENT_RAM or SEGMENT_PROGMEM
+    - on_done: called from transfer_service() once the last byte is out, can use the bus (may be nullptr) */
+typedef struct Transfer {
+    Wiz_Address address;
+    uint16_t len;
+    uint8_t source;
+    const void *data;
+    void (*on_done)(struct Transfer *transfer);
+
+    // Bytes written so far
+    uint16_t progress;
+    bool done;
+} Transfer;
+
+/*  Puts a transfer at the end of the queue.
+    Returns false if the queue is full. */
+bool transfer_queue(Transfer *transfer);
+/* Writes the next slice of the transfer at the front of the queue, if any. */
+void transfer_service();
+/*  Cuts a queued transfer short, dropping whatever hasn't been written yet.
+    It still leaves the queue the usual way, done set and on_done called. */
+void transfer_cancel(Transfer *transfer);
+/* True when nothing is waiting in the queue. */
+bool transfer_idle();
@@ -6,8 +6,16 @@
 #include <avr/io.h>
 
 #define UART_WRITE_PSTR(s) uart_write_P(PSTR(s))
-#define SET_UART_PIN DDRB |= _BV(PB1)
-#define SET_UART_INACTIVE PORTB |= _BV(PB1)
+#define UART_BAUD_RATE 9600
+#if defined(__AVR_ATtiny85__)
+    // Bit-banged through the USI on PB1
+    #define SET_UART_PIN DDRB |= _BV(PB1)
+    #define SET_UART_INACTIVE PORTB |= _BV(PB1)
+#elif defined(__AVR_ATmega328P__)
+    // The USART's TX (PD1, D1), which the UNO passes on to its USB serial
+    #define SET_UART_PIN DDRD |= _BV(PD1)
+    #define SET_UART_INACTIVE PORTD |= _BV(PD1)
+#endif
 
 uint8_t reverse_byte(uint8_t x);
 
@@ -8,15 +8,27 @@
 #include <avr/interrupt.h>
 #include <stdbool.h>
 
+#include "clock.h"
 #include "dhcp.h"
 #include "tcp.h"
 
 
 /* User-relevant macros below */
 
-// Number of sockets available for use in the Wizchip (max. 7 as one is taken by the DHCP client) 
+// The number of sockets available for use in the Wizchip, USER_SOCKETNO, is the size of the TCP socket pool in tcp.h
 // (see SOCKETNO below)
-#define USER_SOCKETNO 1
+
+// Ethernet mode for the PHY (see the PHY_ modes below), all capabilities auto-negotiated by default
+#ifndef PHY_MODE
+    #define PHY_MODE PHY_ALLAN
+#endif
+// Milliseconds between calls to wizchip_link_monitor() from the main loop
+#define LINK_POLL_MS 500u
+// Microseconds the W5500 waits before asserting its interrupt line for a new event (max. 1747), so that
+// events arriving close together take one interrupt and one sweep. Every event gets this much later.
+#ifndef INT_WAIT_US
+    #define INT_WAIT_US 200
+#endif
 
 /* User-relevant macros above */
 
@@ -35,6 +47,19 @@
 #define RST 7
 // Reset (apply config) bit
 #define OPMD 6
+// INTLEVEL for INT_WAIT_US, the wait being (INTLEVEL + 1) * 4 cycles of the 150 MHz PLL clock
+#if INT_WAIT_US > 0
+    #define INTLEVEL_VALUE ((INT_WAIT_US * 75ul) / 2 - 1)
+#else
+    #define INTLEVEL_VALUE 0
+#endif
+#if INTLEVEL_VALUE > 0xFFFF
+    #error "INT_WAIT_US too long for INTLEVEL"
+#endif
+// Link state bits: link up, 100 Mbps, full duplex
+#define LNK 0
+#define SPD 1
+#define DPX 2
 
 // Number of sockets in use (so as to not use more memory to hold them than necessary).
 // W5500 has 8 in total.
@@ -48,17 +73,35 @@
 // The number of sockets reserved for DHCP use
 #define DHCP_SOCKETNO 1
 
-// The number of interrupts that can be stored before new ones get dropped
-#define INTERRUPT_LIST_SIZE 5
+// The W5500's buffer memory, in KB for each of TX and RX, along with how many sockets it has
+#define BUFFER_MEMORY_KB 16
+#define W5500_SOCKETS 8
+// Weights for splitting the buffer memory between the sockets in use. Each gets a power-of-two size in KB,
+// roughly in proportion to its weight (see wizchip_plan_buffers). The DHCP socket keeps its share for good:
+// it has to be socket 0 for MACRAW, and resizing it would move every TCP socket's buffers along with it.
+#define DHCP_BUFFER_WEIGHT 1
+#define TCP_BUFFER_WEIGHT 2
+
+// The number of interrupt events that can be stored before new ones get dropped, a power of two
+// (events for a socket that already has one waiting get merged into it rather than take a slot)
+#define INTERRUPT_RING_SIZE 8
+#define INTERRUPT_RING_MASK (INTERRUPT_RING_SIZE - 1)
 
 
 /* Device structure */
 typedef struct {
     // Nice bits of data about what sockets are in use
     Socket *sockets[SOCKETNO];
-    // A list of interrupts that have arrived from W5500
-    volatile uint8_t interrupt_list[INTERRUPT_LIST_SIZE];
-    volatile uint8_t interrupt_list_index;
+    /*  A ring of interrupt events that have arrived from W5500, each with the socket number in the top three bits.
+    wizchip_service() is the single producer, writing only interrupt_head, and wizchip_pop_interrupt() the single
+    consumer, writing only interrupt_tail. Both run in the main loop, the ISR only flags that there's a sweep to do. */
+    volatile uint8_t interrupt_ring[INTERRUPT_RING_SIZE];
+    volatile uint8_t interrupt_head;
+    volatile uint8_t interrupt_tail;
+    // Events dropped as the ring was full, read with wizchip_interrupt_overflows()
+    volatile uint16_t interrupt_overflows;
+    // The LNK, SPD and DPX bits of PHYCFGR as of the last poll, 0 while the link is down
+    uint8_t link;
 } W5500;
 
 
@@ -69,4 +112,26 @@ extern W5500 Wizchip;
 void setup_wizchip(void);
 
 /* Setting of various registers needed for INT0 interrupts */ 
-void setup_atthing_interrupts(void);
\ No newline at end of file
+void setup_atthing_interrupts(void);
+/*  Splits the W5500's buffer memory between the DHCP socket and the TCP pool by their weights.
+    The plan is fixed, setup_wizchip() applies it before anything opens. Should it ever change, sockets whose
+    buffers resize or move (every socket after the first one that resizes) are closed for it: the DHCP socket
+    is left for the DHCP client to reopen, listening TCP sockets are closed and put back to listening
+    (dropping any connection they had). Does nothing if the plan is already in place. */
+void wizchip_plan_buffers(void);
+/*  Reads the PHY's link state and reports changes over UART, to be called every LINK_POLL_MS or so.
+    When the link comes up, the DHCP client starts over and the TCP sockets go back to listening. */
+void wizchip_link_monitor(void);
+/* The link state as of the last poll as a progmem string, such as "up, 100M full-duplex" */
+const char *wizchip_link_text(void);
+/*  Bottom half of the W5500 interrupt, polled from the main loop: drains the interrupt registers
+    into the ring in one bus session, if the ISR has flagged anything. */
+void wizchip_service(void);
+/*  True when the W5500 has nothing waiting: no interrupt flagged for wizchip_service() and an empty ring.
+    Call with interrupts off to have it stay that way until sleeping. */
+bool wizchip_idle(void);
+/*  Takes the oldest interrupt event off the ring.
+    Returns 0 if there are none, otherwise the interrupt bits with the socket number in the top three bits. */
+uint8_t wizchip_pop_interrupt(void);
+/* The number of interrupt events dropped so far because the ring was full */
+uint16_t wizchip_interrupt_overflows(void);
\ No newline at end of file
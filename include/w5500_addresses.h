@@ -25,6 +25,9 @@
 // Common block - Source IP address
 #define SIPR_B 0x0F
 #define SIPR 0x00, 0x0F, COMMON_BLOCK
+// Common block - Interrupt low level timer register (interrupt assert wait time)
+#define INTLEVEL_B 0x13
+#define INTLEVEL 0x00, 0x13, COMMON_BLOCK
 // Common block - Interrupt register
 #define IR_B 0x15
 #define IR 0x00, 0x15, COMMON_BLOCK
@@ -72,6 +75,12 @@
 // Socket register block - Destination port register
 #define S_DPORT_B 0x10
 #define S_DPORT 0x00, 0x10, SOCKET_BLOCK 
+// Socket register block - RX buffer size in KB
+#define S_RXBUF_SIZE_B 0x1E
+#define S_RXBUF_SIZE 0x00, 0x1E, SOCKET_BLOCK
+// Socket register block - TX buffer size in KB
+#define S_TXBUF_SIZE_B 0x1F
+#define S_TXBUF_SIZE 0x00, 0x1F, SOCKET_BLOCK
 // Free space in the outgoing TX register
 #define S_TX_FSR_B 0x20
 #define S_TX_FSR 0x00, 0x20, SOCKET_BLOCK
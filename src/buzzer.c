@@ -2,51 +2,70 @@
 #include <avr/interrupt.h>
 #include "buzzer.h"
 
-// Timer 1 overflow interrupt checks the elapsed
-// ticks against this variable.
-static volatile uint8_t sound_duration = 0;
 static volatile bool pause = false;
 
-// Set to true when timer 1 ticks exceed
-// the specified `sound_duration`.
-// User is responsible for resetting this flag.
-volatile bool sound_finished = false;
+
+#if defined(__AVR_ATtiny85__)
+    // Timer1 has a top register of its own for the PWM, and drives OC1A (PB1)
+    #define TIMER0_INTERRUPTS TIMSK
+    #define PWM_OUTPUT TCCR1
+    #define PWM_CLOCK TCCR1
+    #define PWM_CONNECT _BV(COM1A0)
+    #define PWM_START _BV(CS10)
+    #define PWM_DUTY OCR1A
+#elif defined(__AVR_ATmega328P__)
+    // Timer2 runs in fast PWM with OCR2A as the top, on OC2B (PD3, D3), clear of both SPI pin maps.
+    // Timer1's outputs are PB1 and PB2, which the bit-banged SPI uses for chip select and MOSI.
+    #define TIMER0_INTERRUPTS TIMSK0
+    #define PWM_OUTPUT TCCR2A
+    #define PWM_CLOCK TCCR2B
+    #define PWM_CONNECT _BV(COM2B1)
+    #define PWM_START _BV(CS20)
+    #define PWM_DUTY OCR2B
+#endif
 
 
 static inline void setup_timer0() {
     TCCR0A |= _BV(WGM01);
-    TIMSK |= _BV(OCIE0A);
+    TIMER0_INTERRUPTS |= _BV(OCIE0A);
 }
 
 
-static inline void setup_timer1() {
-    TCCR1 |= _BV(PWM1A);
-    OCR1C = PWM_STEPS;
-    OCR1A = 0;
+static inline void setup_pwm_timer() {
+    #if defined(__AVR_ATtiny85__)
+        TCCR1 |= _BV(PWM1A);
+        OCR1C = PWM_STEPS;
+    #elif defined(__AVR_ATmega328P__)
+        TCCR2A |= _BV(WGM21) | _BV(WGM20);
+        TCCR2B |= _BV(WGM22);
+        OCR2A = PWM_STEPS;
+        DDRD |= _BV(PD3);
+    #endif
+    PWM_DUTY = 0;
 }
 
 
 void initialize_buzzer() {
     setup_timer0();
-    setup_timer1();
+    setup_pwm_timer();
 }
 
 
-// Sets timer0 and timer1 prescalers to 1
+// Sets timer0 and the PWM timer's prescalers to 1
 // to start them and connects PWM pin to the timer.
 void play_sound() {
     TCCR0B |= _BV(CS00);
-    TCCR1 |= _BV(COM1A0);
-    TCCR1 |= _BV(CS10);
+    PWM_OUTPUT |= PWM_CONNECT;
+    PWM_CLOCK |= PWM_START;
 }
 
 
-// Sets timer0 and timer1 prescalers to 0
+// Sets timer0 and the PWM timer's prescalers to 0
 // to stop them and disconnects PWM pin from the timer.
 void stop_sound() {
     TCCR0B &= ~_BV(CS00);
-    TCCR1 &= ~_BV(COM1A0);
-    TCCR1 &= ~_BV(CS10);
+    PWM_OUTPUT &= ~PWM_CONNECT;
+    PWM_CLOCK &= ~PWM_START;
 }
 
 
@@ -64,13 +83,6 @@ inline void set_sound_frequency(uint8_t frequency) {
 }
 
 
-// Sets the variable which the timer1 overflow interrupt
-// checks the elapsed ticks against.
-inline void set_sound_duration(uint8_t duration) {
-    sound_duration = duration;
-}
-
-
 typedef enum: int8_t {
     DOWN = -1,
     UP = 1
@@ -79,49 +91,25 @@ typedef enum: int8_t {
 
 /*
     Unfortunately Fedora ships AVR LibC 2.2.0 while MSYS2 ships version 2.1.0
-    and the "Timer/Counter1 Compare Match A" vector changed names between these:
+    and the ATtiny85's "Timer/Counter1 Compare Match A" vector changed names between these
+    (the ATmega328P's is TIMER0_COMPA_vect in both):
 
 https://avrdudes.github.io/avr-libc/avr-libc-user-manual-2.2.0/group__avr__interrupts.html
 https://avrdudes.github.io/avr-libc/avr-libc-user-manual-2.1.0/group__avr__interrupts.html
 */
-#if __AVR_LIBC_MINOR__ == 2
+#if __AVR_LIBC_MINOR__ == 2 || defined(__AVR_ATmega328P__)
 ISR(TIMER0_COMPA_vect) {
 #else
 ISR(TIM0_COMPA_vect) {
 #endif
+    // Note durations are timed by the system clock (clock.h),
+    // this only shapes the waveform.
+
     // `direction` needs to be initialized as DOWN.
     // Otherwise it will break the PWM. Do not touch this.
     static direction_e direction = DOWN;
-    static uint8_t timer_ticks[2] = {};
-    static uint8_t ms_ticks = 0;
-
-    uint8_t compare_value = OCR0A;
-
-    // First byte of `timer_ticks` hasn't overflowed
-    if ((timer_ticks[0] += compare_value) >= compare_value) {
-        goto adjust_pulse_width;
-    }
-
-    // Less than ~7936 ticks in total have elapsed
-    // (0.992ms @ 8MHz)
-    if (++timer_ticks[1] < 0x1f) {
-        goto adjust_pulse_width;
-    }
-
-    timer_ticks[0] = 0;
-    timer_ticks[1] = 0;
-
-    // Enough ticks for ~0.992ms elapsed -> increment ms counter
-    // and check against duration
-    if (++ms_ticks < sound_duration) {
-        goto adjust_pulse_width;
-    }
-
-    ms_ticks = 0;
-    sound_finished = true;
 
-adjust_pulse_width:
-    uint8_t current = OCR1A;
+    uint8_t current = PWM_DUTY;
 
     // Change counting direction when register maximum
     // or desired minimum is reacher.
@@ -140,6 +128,6 @@ adjust_pulse_width:
     // which adjusts the pulse width to generate a
     // triangle wave.
     if (!pause)
-        OCR1A += direction;
+        PWM_DUTY += direction;
 }
 
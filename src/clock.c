@@ -0,0 +1,144 @@
+/*
+    System clock for the ATmega328P and ATtiny85.
+*/
+
+#include "clock.h"
+
+#if defined(__AVR_ATtiny85__)
+    #define CLOCK_vect WDT_vect
+#elif defined(__AVR_ATmega328P__)
+    #define CLOCK_vect TIMER1_COMPA_vect
+    // CTC at clk/64
+    #define CLOCK_TICKS ((F_CPU / 64 / 1000 * CLOCK_TICK_MS) - 1)
+#endif
+
+#define WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+// The slot of the tick at time
+#define WHEEL_SLOT(time) (((time) / CLOCK_TICK_MS) & WHEEL_MASK)
+
+static volatile uint32_t now = 0;
+
+// Timers are only touched from the main loop, none of this is shared with interrupts
+static Timer *wheel[TIMER_WHEEL_SLOTS];
+// The tick whose slot timer_service() looks at next
+static uint32_t wheel_time = 0;
+static uint8_t armed_timers = 0;
+
+
+/* Starts the tick interrupt. */
+void clock_init(void) {
+    #if defined(__AVR_ATtiny85__)
+        // Interrupt mode only, the WDTON fuse must be left unprogrammed
+        WDTCR = _BV(WDIE);
+    #elif defined(__AVR_ATmega328P__)
+        TCCR1A = 0;
+        TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10);
+        OCR1A = CLOCK_TICKS;
+        TIMSK1 |= _BV(OCIE1A);
+    #endif
+}
+
+/*  Milliseconds since clock_init(), in steps of CLOCK_TICK_MS. Wraps around after ~49 days.
+    Only moves while interrupts are on. */
+uint32_t now_ms(void) {
+    // Four bytes can't be read in one go, so the tick mustn't land in the middle
+    uint8_t sreg = SREG;
+    cli();
+    uint32_t ms = now;
+    SREG = sreg;
+    return ms;
+}
+
+/* A deadline at least ms milliseconds from now, for timeout_expired() */
+uint32_t timeout_in(uint32_t ms) {
+    // The next tick may be just about to land, so it doesn't count as a whole one
+    return now_ms() + ms + CLOCK_TICK_MS;
+}
+
+/* True once the deadline from timeout_in() has passed */
+bool timeout_expired(uint32_t deadline) {
+    // Signed difference, so that the wrap-around doesn't matter
+    return (int32_t)(now_ms() - deadline) >= 0;
+}
+
+/* Arms the timer to run callback in at least delay_ms milliseconds, rearming it if it already was. */
+void timer_start(Timer *timer, uint32_t delay_ms, void (*callback)(Timer *timer)) {
+    timer_stop(timer);
+
+    if (armed_timers == 0) {
+        // The wheel stood still with nothing on it, catch it up
+        wheel_time = now_ms();
+    }
+
+    // Rounded up to a tick, as that's when the time reaches it. Left in between ticks, the timer would
+    // sit in the slot of the tick before its deadline and be passed over for a whole turn of the wheel.
+    uint32_t expires = timeout_in(delay_ms);
+    expires = (expires + CLOCK_TICK_MS - 1) / CLOCK_TICK_MS * CLOCK_TICK_MS;
+    // Slots up to wheel_time have been looked at already
+    if ((int32_t)(expires - wheel_time) < 0) {
+        expires = wheel_time;
+    }
+
+    timer->expires = expires;
+    timer->callback = callback;
+    timer->armed = true;
+
+    Timer **slot = &wheel[WHEEL_SLOT(expires)];
+    timer->next = *slot;
+    *slot = timer;
+    armed_timers++;
+}
+
+/* Disarms the timer, if it is armed. */
+void timer_stop(Timer *timer) {
+    if (!timer->armed) {
+        return;
+    }
+
+    for (Timer **link = &wheel[WHEEL_SLOT(timer->expires)]; *link; link = &(*link)->next) {
+        if (*link == timer) {
+            *link = timer->next;
+            break;
+        }
+    }
+
+    timer->armed = false;
+    armed_timers--;
+}
+
+/* True when some timer's slot has come around and timer_service() has something to look at. */
+bool timer_due(void) {
+    return armed_timers && (int32_t)(now_ms() - wheel_time) >= 0;
+}
+
+/* Runs the callbacks of the timers that have expired. Callbacks may arm and stop timers, including their own. */
+void timer_service(void) {
+    uint32_t time = now_ms();
+
+    // Turn the wheel up to now
+    while (armed_timers && (int32_t)(time - wheel_time) >= 0) {
+        // Timers in the slot that aren't expired yet are due on a later turn of the wheel
+        Timer **link = &wheel[WHEEL_SLOT(wheel_time)];
+        while (*link && (int32_t)(time - (*link)->expires) < 0) {
+            link = &(*link)->next;
+        }
+
+        if (!*link) {
+            wheel_time += CLOCK_TICK_MS;
+            continue;
+        }
+
+        Timer *timer = *link;
+        *link = timer->next;
+        timer->armed = false;
+        armed_timers--;
+
+        // May change the slot, so it gets looked through again from the start
+        timer->callback(timer);
+    }
+}
+
+ISR(CLOCK_vect) {
+    now += CLOCK_TICK_MS;
+    // That's all, the work falling due (the transfer queue included) runs from the main loop it wakes up
+}
@@ -0,0 +1,22 @@
+/*
+    CRC-32 (IEEE 802.3), a nibble at a time from a table in progmem.
+*/
+
+#include "crc32.h"
+
+/*  The reflected polynomial 0xEDB88320 applied to each 4-bit value. Half a byte at a time keeps the table
+    at 64 bytes of flash, where a byte-wise one would take 1 KB, for two lookups per byte instead of one. */
+static const uint32_t crc32_nibbles[16] PROGMEM = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+
+/*  Folds a byte into the running CRC, started from CRC32_INIT.
+    The finished CRC is the complement of the running one, sent least significant byte first. */
+uint32_t crc32_update(uint32_t crc, uint8_t byte) {
+    crc ^= byte;
+    crc = (crc >> 4) ^ pgm_read_dword(&crc32_nibbles[crc & 0x0F]);
+    crc = (crc >> 4) ^ pgm_read_dword(&crc32_nibbles[crc & 0x0F]);
+    return crc;
+}
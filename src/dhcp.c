@@ -3,23 +3,152 @@
 */
 
 #include "dhcp.h"
+#include "w5500.h"
+#include "crc32.h"
+#include "entropy.h"
+#include <avr/eeprom.h>
 
 const uint8_t macraw_frame[MACRAW_H_LEN] PROGMEM = {BROADCAST_MAC, MAC_ADDRESS, IPv4,
     IPv4_INFO, DIFFSERV, 0x00, 0x00, IPv4_ID, IPv4_FLAGS, TTL, PROTOCOL_UDP, 0x00, 0x00, NULL_IP_ADDR, BROADCAST_IP_ADDR,
     UDP_SOURCE_PORT, UDP_DEST_PORT, 0x00, 0x00, 0x00, 0x00};
-const uint8_t dhcp_frame_start[DHCP_H_START_LEN] PROGMEM = {BOOTREQUEST, HTYPE, HLEN, HOPS, XID, [10] = FLAGS, [28] = MAC_ADDRESS};
+const uint8_t dhcp_frame_start[DHCP_H_START_LEN] PROGMEM = {BOOTREQUEST, HTYPE, HLEN, HOPS, [10] = FLAGS, [28] = MAC_ADDRESS};
 const uint8_t discover_options[DISCOVER_OPTIONS_LEN] PROGMEM = {MAGIC_COOKIE, MESSAGETYPE, DISCOVER, REQUESTED_IP, END, 0x00};
 const uint8_t request_options[REQUEST_OPTIONS_LEN] PROGMEM = {MAGIC_COOKIE, MESSAGETYPE, REQUEST, REQUESTED_IP, SERVER, DOMAIN_DATA, END};
-
+// Renewing and rebinding requests name neither the address nor the server, the address goes in CIADDR instead
+const uint8_t renew_options[RENEW_OPTIONS_LEN] PROGMEM = {MAGIC_COOKIE, MESSAGETYPE, REQUEST, DOMAIN_DATA, END};
+// Requests to keep a lease after a reboot name the address but not the server
+const uint8_t reboot_options[REBOOT_OPTIONS_LEN] PROGMEM = {MAGIC_COOKIE, MESSAGETYPE, REQUEST, REQUESTED_IP, DOMAIN_DATA, END};
+
+
+#ifndef DHCP_UDP
+// Adds the carries of a one's complement sum back into its lower 16 bits
+#define CHECKSUM_FOLD(sum) (((sum) & 0xFFFF) + ((sum) >> 16))
+// The sum of two bytes, or of four as two words, from the comma-separated lists in dhcp.h
+#define WORD(...) WORD_(__VA_ARGS__)
+#define WORD_(high, low) (((uint32_t)(high) << 8) | (low))
+#define WORDS(...) WORDS_(__VA_ARGS__)
+#define WORDS_(a, b, c, d) (WORD_(a, b) + WORD_(c, d))
+
+/*  The checksum of the IPv4 header in macraw_frame, where the total length is still 0.
+    Everything else in it is fixed, so only the length (and for unicasts the addresses)
+    has to be patched in at send time (see ipv4_header_prep). */
+constexpr uint16_t ipv4_template_checksum = (uint16_t)~CHECKSUM_FOLD(CHECKSUM_FOLD(
+    WORD(IPv4_INFO, DIFFSERV) + WORD(IPv4_ID) + WORD(IPv4_FLAGS) + WORD(TTL, PROTOCOL_UDP)
+    + WORDS(NULL_IP_ADDR) + WORDS(BROADCAST_IP_ADDR)
+));
+// The sum of an IPv4 address in RAM as two words
+#define ADDRESS_WORDS(address) WORDS_((address)[0], (address)[1], (address)[2], (address)[3])
+#endif
+
+// A place in the DHCP socket's RX buffer
+#define RX_ADDRESS(rx_pointer) BUFFER_ADDRESS((rx_pointer), S_RX_BUF_BLOCK, DHCP_Socket.sockno)
+
+#ifdef DHCP_UDP
+    #define DHCP_SOCKET_MODE UDP_BROADCAST_MODE
+    // The W5500 makes the link layer, IPv4 and UDP headers itself, so only the DHCP message goes in the buffers.
+    // Positions are still counted from where a MACRAW frame would start, FRAME_HEADERS_LEN before the message,
+    // so the same offsets work for both.
+    #define FRAME_HEADERS_LEN MACRAW_H_LEN
+    // The frames' first segments, the headers, are left out
+    #define FIRST_SEGMENT HEADER_SEGMENTS
+#else
+    #define DHCP_SOCKET_MODE MACRAW_MODE
+    #define FRAME_HEADERS_LEN 0
+    #define FIRST_SEGMENT 0
+#endif
+
+/*  The link layer, IPv4 and UDP headers as frame segments, with the lengths and the IPv4 checksum
+    from ipv4_header_prep() spliced into the template from fields */
+#define HEADER_SEGMENTS 7
+#define FRAME_HEADERS(fields) \
+    {0, (ETH_H_LEN + IPv4_LENGTH_STEP), SEGMENT_PROGMEM, .data = macraw_frame}, \
+    {(ETH_H_LEN + IPv4_LENGTH_STEP), 2, SEGMENT_RAM, .data = (fields)}, \
+    {(ETH_H_LEN + IPv4_LENGTH_STEP + 2), (IPv4_CHECKSUM_STEP - IPv4_LENGTH_STEP - 2), SEGMENT_PROGMEM, .data = macraw_frame + ETH_H_LEN + IPv4_LENGTH_STEP + 2}, \
+    {(ETH_H_LEN + IPv4_CHECKSUM_STEP), 2, SEGMENT_RAM, .data = (fields) + 2}, \
+    {(ETH_H_LEN + IPv4_CHECKSUM_STEP + 2), (UDP_LENGTH_STEP - IPv4_CHECKSUM_STEP - 2), SEGMENT_PROGMEM, .data = macraw_frame + ETH_H_LEN + IPv4_CHECKSUM_STEP + 2}, \
+    {(ETH_H_LEN + UDP_LENGTH_STEP), 2, SEGMENT_RAM, .data = (fields) + 4}, \
+    {(ETH_H_LEN + UDP_LENGTH_STEP + 2), (MACRAW_H_LEN - ETH_H_LEN - UDP_LENGTH_STEP - 2), SEGMENT_PROGMEM, .data = macraw_frame + ETH_H_LEN + UDP_LENGTH_STEP + 2}
+
+#ifndef DHCP_UDP
+// Where the IPv4 addresses are in the IPv4 header
+#define IPv4_SOURCE_STEP 12
+#define IPv4_DEST_STEP 16
+/*  FRAME_HEADERS() for a frame unicast from our address to the server,
+    with its MAC and both addresses spliced in too (from DHCP) */
+#define UNICAST_HEADERS(fields) \
+    {0, 6, SEGMENT_RAM, .data = DHCP.server_mac}, \
+    {6, (ETH_H_LEN + IPv4_LENGTH_STEP - 6), SEGMENT_PROGMEM, .data = macraw_frame + 6}, \
+    {(ETH_H_LEN + IPv4_LENGTH_STEP), 2, SEGMENT_RAM, .data = (fields)}, \
+    {(ETH_H_LEN + IPv4_LENGTH_STEP + 2), (IPv4_CHECKSUM_STEP - IPv4_LENGTH_STEP - 2), SEGMENT_PROGMEM, .data = macraw_frame + ETH_H_LEN + IPv4_LENGTH_STEP + 2}, \
+    {(ETH_H_LEN + IPv4_CHECKSUM_STEP), 2, SEGMENT_RAM, .data = (fields) + 2}, \
+    {(ETH_H_LEN + IPv4_SOURCE_STEP), 4, SEGMENT_RAM, .data = DHCP.our_ip}, \
+    {(ETH_H_LEN + IPv4_DEST_STEP), 4, SEGMENT_RAM, .data = DHCP.server}, \
+    {(ETH_H_LEN + IPv4_DEST_STEP + 4), (UDP_LENGTH_STEP - IPv4_DEST_STEP - 4), SEGMENT_PROGMEM, .data = macraw_frame + ETH_H_LEN + IPv4_DEST_STEP + 4}, \
+    {(ETH_H_LEN + UDP_LENGTH_STEP), 2, SEGMENT_RAM, .data = (fields) + 4}, \
+    {(ETH_H_LEN + UDP_LENGTH_STEP + 2), (MACRAW_H_LEN - ETH_H_LEN - UDP_LENGTH_STEP - 2), SEGMENT_PROGMEM, .data = macraw_frame + ETH_H_LEN + UDP_LENGTH_STEP + 2}
+#endif
+
+/* The frame's DHCP message from dhcp_frame_start up to step, with our transaction ID spliced in */
+#define MESSAGE_START(step) \
+    {DHCP_H_START_STEP, (XID_STEP - DHCP_H_START_STEP), SEGMENT_PROGMEM, .data = dhcp_frame_start}, \
+    {XID_STEP, 4, SEGMENT_RAM, .data = DHCP.xid}, \
+    {(XID_STEP + 4), ((step) - XID_STEP - 4), SEGMENT_PROGMEM, .data = dhcp_frame_start + (XID_STEP + 4 - DHCP_H_START_STEP)}
+
+/* Slots in Reply_Options for the options picked out of replies */
+#define OPT_MESSAGE_TYPE 0
+#define OPT_SERVER 1
+#define OPT_SUBNET 2
+#define OPT_ROUTER 3
+#define OPT_LEASE 4
+#define OPT_T1 5
+#define OPT_T2 6
+#define OPT_SLOTS 7
+
+/* Where parse_options() is in the options area */
+#define TLV_COOKIE 0
+#define TLV_CODE 1
+#define TLV_LEN 2
+#define TLV_VALUE 3
+#define TLV_END 4
+#define TLV_BAD_COOKIE 5
+
+/*  What parse_options() found in a reply, kept here until check_if_dhcp() has accepted it
+    and read_dhcp_reply() takes what it needs */
+typedef struct {
+    // The offered IP (YIADDR), from the fixed part of the message
+    uint8_t our_ip[4];
+    // Option values by slot, as they were on the wire (big-endian); router lists only keep their first address
+    uint8_t values[OPT_SLOTS][4];
+    // A bit per slot for the options that came in whole
+    uint8_t found;
+    // Parser state (TLV_*), the slot of the option being read (OPT_SLOTS when it's skipped),
+    // bytes of it (or of the magic cookie) read so far and bytes left
+    uint8_t state;
+    uint8_t slot;
+    uint8_t pos;
+    uint8_t remaining;
+} Reply_Options;
+
+/* The addresses of the last acquired lease, kept in EEPROM to ask for again after a power cycle */
+typedef struct {
+    uint8_t our_ip[4];
+    uint8_t server[4];
+    uint8_t submask[4];
+    uint8_t router[4];
+    // The complement of the sum of the bytes above, so that blank (all 0xFF) or half-written EEPROM doesn't pass
+    uint8_t check;
+} Saved_Lease;
 
 /* A single instance of DHCP Client for our use. */
 DHCP_Client DHCP;
 Socket DHCP_Socket;
+static Reply_Options Reply;
+static Saved_Lease saved_lease EEMEM;
 
 
 /* Message composition */
-/* Initializes W5500's IP data as null, and socket 0 as MACRAW */
-void setup_macraw();
+/* Sets socket 0 up for DHCP messages, in MACRAW mode (or UDP mode with DHCP_UDP) */
+void setup_dhcp_socket();
 /* Compiles a frame from various options, sends it to recipient. */
 void send_dhcp_frame();
 
@@ -29,70 +158,122 @@ information if it is. */
 void parse_packet();
 /* Checks whether a message's profile fits that of a DHCP reply. */
 int8_t check_if_dhcp(uint16_t read_pointer, uint16_t received_amount);
-/* Extracts information from a DHCP reply. */
+/* Extracts information from a DHCP reply accepted by check_if_dhcp(). */
 void read_dhcp_reply(uint16_t read_pointer);
+/* Sets the renewal (T1), rebinding (T2) and expiry deadlines from the lease times in DHCP */
+static void set_lease_timeouts();
+/* Half the time left until deadline but at least RENEW_RETRY_MIN_MS, for repeating requests while renewing or rebinding */
+static uint32_t retry_in(uint32_t deadline);
+/* The wait before repeating a message sent retries times before, with the backoff and jitter from RETRY_BASE_MS etc. */
+static uint32_t backoff_delay(uint8_t retries);
+/* Goes back to discovering, sending the discover after a random wait of up to DISCOVER_JITTER_MS */
+static void start_discover();
+/* Saves the lease's addresses from DHCP into EEPROM, writing only the bytes that changed */
+static void save_lease();
+/* Loads the addresses saved with save_lease() into DHCP. Returns false if there's no valid lease saved. */
+static bool load_lease();
+/* The check byte of a Saved_Lease */
+static uint8_t lease_check(const Saved_Lease *lease);
+/* read_stream() sink walking the options area (magic cookie included) into Reply */
+static void parse_options(const uint8_t *block, uint8_t block_len);
+/* The Reply slot for an option code, OPT_SLOTS for options that aren't kept */
+static uint8_t option_slot(uint8_t code);
+/* A four byte option as a number, 0 if the reply didn't have it */
+static uint32_t option_value(uint8_t slot);
 
 /* Reads the contents of a buffer and pushes them out the UART line */
-void from_wizchip_to_uart(uint16_t message_len);
+void from_wizchip_to_uart(Wiz_Address address, uint16_t message_len);
 
-/* Writes packet lengths and IPv4 checksum into headers */
-void ipv4_header_prep(uint16_t message_len);
-/* Calculates a CRC-32 frame check sequence used in an ethernet frame */
-void calculate_fcs(uint16_t message_len);
-void shuffle_window(uint8_t *window);
-void xor_window(uint8_t *window);
+#ifndef DHCP_UDP
+/*  Works out the packet lengths and the IPv4 checksum for the headers of a message_len long frame,
+    writing them into fields as the IPv4 length, the checksum and the UDP length, two bytes each.
+    The checksum is for a broadcast from 0.0.0.0, or for a unicast from our address to the server's. */
+void ipv4_header_prep(uint8_t *fields, uint16_t message_len, bool unicast);
+#endif
 
 
 void dhcp_setup() {
     ASSIGN(DHCP.our_ip, 0, 0, 0, 0, 0);
     ASSIGN(DHCP.server, 0, 0, 0, 0, 0);
     ASSIGN(DHCP.submask, 0, 0, 0, 0, 0);
-    DHCP.dhcp_status = DISCOVER;
-    DHCP.dhcp_lease_time = 0;
+    ASSIGN(DHCP.router, 0, 0, 0, 0, 0);
+    DHCP.sent_status = 0;
+
+    // A new transaction ID from the MAC and some noise, which also seeds the jitter of the retries
+    const uint8_t mac[6] = {MAC_ADDRESS};
+    uint32_t seed = CRC32_INIT;
+    for (uint8_t i = 0; i < 6; i++) {
+        seed = crc32_update(seed, mac[i]);
+    }
+    seed = ~entropy_gather(seed);
+    ASSIGN(DHCP.xid, 0, seed >> 24, seed >> 16, seed >> 8, seed);
+    srandom(seed);
 
     // Pushes DHCP network values (IP, server etc.) to W5500's network registers
     set_network();
 
-    // Initialises socket 0 in MACRAW mode
-    setup_macraw();
+    // Initialises socket 0 in MACRAW or UDP mode
+    setup_dhcp_socket();
 
-    // Send the first DHCP discover
-    send_dhcp_frame();
+    // If a lease was saved before the reboot, ask to keep it right away. Its addresses only go
+    // to the W5500 once the server has agreed. Otherwise the tracker sends the first discover.
+    if (load_lease()) {
+        DHCP.dhcp_status = REBOOTING;
+        send_dhcp_frame();
+    } else {
+        start_discover();
+    }
 }
 
 /* A continuously polled function that occasionally repeats requests */
 void dhcp_tracker() {
-    DHCP.dhcp_lease_time++;
-
     switch (DHCP.dhcp_status) {
         case FRESH_ACQUIRED:
             DHCP.dhcp_status = ACQUIRED;
             __attribute__ ((fallthrough));
         case ACQUIRED:
-            // Something to check remaining lease duration and re-request if needed
-            if (DHCP.dhcp_lease_time == UINT32_MAX) {
+        case RENEWING:
+        case REBINDING:
+            if (timeout_expired(DHCP.lease_expiry)) {
                 DHCP.dhcp_status = EXPIRED;
-                DHCP.dhcp_lease_time = 0;
                 break;
             }
-            if (DHCP.dhcp_lease_time < (UINT32_MAX >> 1)) {
+            // Past T2 with no word from our server, any server may extend the lease, so broadcast right away
+            if (DHCP.dhcp_status != REBINDING && timeout_expired(DHCP.rebind_timeout)) {
+                DHCP.dhcp_status = REBINDING;
+                DHCP.dhcp_timeout = now_ms();
+            }
+            if (!timeout_expired(DHCP.dhcp_timeout)) {
                 break;
             }
-            DHCP.dhcp_status = REQUEST;
-            setup_macraw();
+            // Past T1, ask the server that gave the lease to extend it
+            if (DHCP.dhcp_status == ACQUIRED) {
+                DHCP.dhcp_status = RENEWING;
+            }
             send_dhcp_frame();
+            DHCP.dhcp_timeout = retry_in((DHCP.dhcp_status == RENEWING) ? DHCP.rebind_timeout : DHCP.lease_expiry);
+            break;
+        case REBOOTING:
+            // No answer about the saved lease, go get a new one
+            if (timeout_expired(DHCP.dhcp_timeout)) {
+                start_discover();
+            }
             break;
         // Default back to discover if something goes wrong
         default:
         // Assume that everything will have changed after expiration
         case EXPIRED:
-            DHCP.dhcp_status = DISCOVER;
-            setup_macraw();
-            __attribute__ ((fallthrough));
+            start_discover();
+            break;
         case DISCOVER:
         case REQUEST:
             // Don't spam the router
-            if (DHCP.dhcp_lease_time < MESSAGE_DELAY) {
+            if (!timeout_expired(DHCP.dhcp_timeout)) {
+                break;
+            }
+            // The offer's server has gone quiet, look for another
+            if (DHCP.dhcp_status == REQUEST && DHCP.sent_status == REQUEST && DHCP.retries >= REQUEST_RETRIES) {
+                start_discover();
                 break;
             }
             send_dhcp_frame();
@@ -110,35 +291,39 @@ void dhcp_interrupt() {
 
 void set_network() {
     uint8_t array[6] = {MAC_ADDRESS};
-    set_address(SHAR);
-    write(6, array);
+    write(ADDRESS(SHAR), 6, array);
 
-    set_half_address(SIPR_B);
-    write(4, DHCP.our_ip);
+    write(ADDRESS(SIPR), 4, DHCP.our_ip);
 
-    set_half_address(GAR_B);
-    write(4, DHCP.server);
+    write(ADDRESS(GAR), 4, DHCP.router);
 
-    set_half_address(SUBR_B);
-    write(4, DHCP.submask);
+    write(ADDRESS(SUBR), 4, DHCP.submask);
 }
 
-void setup_macraw() {
-    socket_initialise(&DHCP_Socket, MACRAW_MODE, CLIENT_PORT, RECV_INT);
+void setup_dhcp_socket() {
+    socket_initialise(&DHCP_Socket, DHCP_SOCKET_MODE, CLIENT_PORT, RECV_INT);
 
-    // Destination address to 255.255.255.255 for broadcast
-    set_address(S_DIPR);
-    embed_socket(1);
-    write_singular(4, 0xFF);
-
-    // Set the destination MAC to FF-FF-FF-FF-FF-FF for broadcast
-    set_half_address(S_DHAR_B);
-    write_singular(6, 0xFF);
-
-    // Destination port to 67 for DHCP server
-    uint8_t array[] = {(SERVER_PORT >> 8), SERVER_PORT};
-    set_half_address(S_DPORT_B);
-    write(2, array);
+    // Renewals go straight to the server's address, the W5500 finds its MAC (in MACRAW mode the frame says where it goes anyway).
+    // The broadcast destination has to be written again afterwards.
+    if (DHCP.dhcp_status == RENEWING) {
+        write(SOCKET_ADDRESS(S_DIPR, DHCP_Socket.sockno), 4, DHCP.server);
+        DHCP_Socket.shadowed &= ~SHADOW_DEST;
+    }
+    // Destination MAC to FF-FF-FF-FF-FF-FF and address to 255.255.255.255 for broadcast,
+    // destination port to 67 for DHCP server (only the last two matter in UDP mode). The registers are adjacent, so it's all one burst,
+    // and it only needs to go out once as nothing else touches them.
+    else if (DHCP_Socket.shadowed & SHADOW_DEST) {
+        STAT_ADD(saved, 1);
+    } else {
+        const uint8_t port[] = {(SERVER_PORT >> 8), SERVER_PORT};
+        const Segment destination[] = {
+            {0, 6, SEGMENT_FILL, .fill = 0xFF},
+            {(S_DIPR_B - S_DHAR_B), 4, SEGMENT_FILL, .fill = 0xFF},
+            {(S_DPORT_B - S_DHAR_B), 2, SEGMENT_RAM, .data = port},
+        };
+        write_segments(SOCKET_ADDRESS(S_DHAR, DHCP_Socket.sockno), sizeof(destination) / sizeof(Segment), destination);
+        DHCP_Socket.shadowed |= SHADOW_DEST;
+    }
 
     socket_open(&DHCP_Socket);
     socket_toggle_interrupts(&DHCP_Socket, ON);
@@ -146,212 +331,442 @@ void setup_macraw() {
 
 
 void send_dhcp_frame() {
-    setup_macraw();
-
-    uint16_t pointer = DHCP_Socket.tx_pointer;
-    // Used for both tracking initial pointer position and to hold the message length
-    uint16_t placeholder = DHCP_Socket.tx_pointer;
-
-    set_address((pointer >> 8), pointer, S_TX_BUF_BLOCK);
-
-    /* Step 1: write in the link layer + IPv4 + UDP headers */
-    write_P(MACRAW_H_LEN, macraw_frame);
-    pointer += MACRAW_H_LEN;
-
-    // Send in the base frame start
-    embed_pointer(pointer);
-    write_P(DHCP_H_START_LEN, dhcp_frame_start);
-    pointer += DHCP_H_START_LEN;
+    // Socket setup, frame, checksums and send command all go out in one bus session
+    bus_begin();
+
+    setup_dhcp_socket();
+
+    bool renewal = (DHCP.dhcp_status == RENEWING || DHCP.dhcp_status == REBINDING);
+    bool request = (DHCP.dhcp_status == REQUEST);
+    bool reboot = (DHCP.dhcp_status == REBOOTING);
+    // Where the frame starts (or would start, if the W5500 makes the headers)
+    uint16_t pointer = DHCP_Socket.tx_pointer - FRAME_HEADERS_LEN;
+    // The frame's length, without the frame check sequence
+    uint16_t frame_len = MAGIC_COOKIE_STEP;
+    if (renewal) {
+        frame_len += RENEW_OPTIONS_LEN;
+    } else if (request) {
+        frame_len += REQUEST_OPTIONS_LEN;
+    } else {
+        frame_len += (reboot) ? REBOOT_OPTIONS_LEN : DISCOVER_OPTIONS_LEN;
+    }
 
-    // Fill rest of hardware address and additional options with zeroes
-    embed_pointer(pointer);
-    write_singular(DHCP_H_ZEROES, 0x00);
-    pointer += DHCP_H_ZEROES;
+    Wiz_Address message = BUFFER_ADDRESS(pointer, S_TX_BUF_BLOCK, DHCP_Socket.sockno);
+
+    // Header fields that depend on the message, and the frame check sequence folded up as the frame goes out
+    uint8_t fields[6];
+    // The first of the frame's segments to write, past the headers when they aren't the broadcast ones
+    uint8_t first = FIRST_SEGMENT;
+    #ifdef DHCP_UDP
+        // The W5500 takes care of all of it
+        uint32_t *crc = nullptr;
+    #else
+        uint32_t fcs = CRC32_INIT;
+        uint32_t *crc = &fcs;
+        bool unicast = (DHCP.dhcp_status == RENEWING);
+        ipv4_header_prep(fields, frame_len, unicast);
+
+        // Unicast headers go in a burst of their own, ahead of the rest of the frame
+        if (unicast) {
+            const Segment headers[] = {UNICAST_HEADERS(fields)};
+            write_segments_crc(message, sizeof(headers) / sizeof(Segment), headers, crc);
+            first = HEADER_SEGMENTS;
+        }
+    #endif
 
-    // Write in options
-    embed_pointer(pointer);
-    if ((DHCP.dhcp_status & 0x0F) == DISCOVER) {
-        write_P(DISCOVER_OPTIONS_LEN, discover_options);
-        pointer += DISCOVER_OPTIONS_LEN;
+    /* The whole frame goes out in one burst: link layer + IPv4 + UDP headers, the base frame start,
+    zeroes over the rest of the hardware address and additional options, and the options with
+    our requested IP (and for requests the server, which is also written into SIADDR) spliced in.
+    Renewals carry our address in CIADDR instead. */
+    if (renewal) {
+        const Segment frame[] = {
+            FRAME_HEADERS(fields),
+            MESSAGE_START(CIADDR_STEP),
+            {CIADDR_STEP, 4, SEGMENT_RAM, .data = DHCP.our_ip},
+            {(CIADDR_STEP + 4), (DHCP_H_START_LEN - (CIADDR_STEP + 4 - DHCP_H_START_STEP)), SEGMENT_PROGMEM, .data = dhcp_frame_start + (CIADDR_STEP + 4 - DHCP_H_START_STEP)},
+            {DHCP_H_ZEROES_STEP, DHCP_H_ZEROES, SEGMENT_FILL, .fill = 0x00},
+            {MAGIC_COOKIE_STEP, RENEW_OPTIONS_LEN, SEGMENT_PROGMEM, .data = renew_options},
+        };
+        write_segments_crc(message, sizeof(frame) / sizeof(Segment) - first, frame + first, crc);
     }
-    if ((DHCP.dhcp_status & 0x0F) == REQUEST) {
-        write_P(REQUEST_OPTIONS_LEN, request_options);
-        pointer += REQUEST_OPTIONS_LEN;
-
-        // Write the server we're requesting the IP from to both options and SIADDR
-        embed_pointer(placeholder + SIADDR_STEP);
-        write(4, DHCP.server);
-        embed_pointer(placeholder + MAGIC_COOKIE_STEP + COOKIE_TO_SERVER_STEP);
-        write(4, DHCP.server);
+    else if (request) {
+        const Segment frame[] = {
+            FRAME_HEADERS(fields),
+            MESSAGE_START(SIADDR_STEP),
+            {SIADDR_STEP, 4, SEGMENT_RAM, .data = DHCP.server},
+            {(SIADDR_STEP + 4), (DHCP_H_ZEROES_STEP - SIADDR_STEP - 4), SEGMENT_PROGMEM, .data = dhcp_frame_start + (SIADDR_STEP + 4 - DHCP_H_START_STEP)},
+            {DHCP_H_ZEROES_STEP, DHCP_H_ZEROES, SEGMENT_FILL, .fill = 0x00},
+            {MAGIC_COOKIE_STEP, (REQUESTED_IP_STEP - MAGIC_COOKIE_STEP), SEGMENT_PROGMEM, .data = request_options},
+            {REQUESTED_IP_STEP, 4, SEGMENT_RAM, .data = DHCP.our_ip},
+            {(REQUESTED_IP_STEP + 4), (COOKIE_TO_SERVER_STEP - (REQUESTED_IP_STEP + 4 - MAGIC_COOKIE_STEP)), SEGMENT_PROGMEM, .data = request_options + (REQUESTED_IP_STEP + 4 - MAGIC_COOKIE_STEP)},
+            {(MAGIC_COOKIE_STEP + COOKIE_TO_SERVER_STEP), 4, SEGMENT_RAM, .data = DHCP.server},
+            {(MAGIC_COOKIE_STEP + COOKIE_TO_SERVER_STEP + 4), (REQUEST_OPTIONS_LEN - COOKIE_TO_SERVER_STEP - 4), SEGMENT_PROGMEM, .data = request_options + COOKIE_TO_SERVER_STEP + 4},
+        };
+        write_segments_crc(message, sizeof(frame) / sizeof(Segment) - first, frame + first, crc);
+    }
+    else {
+        // Discovers and requests for the saved lease only differ in their options
+        const uint8_t *options = (reboot) ? reboot_options : discover_options;
+        const Segment frame[] = {
+            FRAME_HEADERS(fields),
+            MESSAGE_START(DHCP_H_START_STEP + DHCP_H_START_LEN),
+            {DHCP_H_ZEROES_STEP, DHCP_H_ZEROES, SEGMENT_FILL, .fill = 0x00},
+            {MAGIC_COOKIE_STEP, (REQUESTED_IP_STEP - MAGIC_COOKIE_STEP), SEGMENT_PROGMEM, .data = options},
+            {REQUESTED_IP_STEP, 4, SEGMENT_RAM, .data = DHCP.our_ip},
+            {(REQUESTED_IP_STEP + 4), (frame_len - REQUESTED_IP_STEP - 4), SEGMENT_PROGMEM, .data = options + (REQUESTED_IP_STEP + 4 - MAGIC_COOKIE_STEP)},
+        };
+        write_segments_crc(message, sizeof(frame) / sizeof(Segment) - first, frame + first, crc);
     }
 
-    // Write in our requested IP address
-    embed_pointer(placeholder + REQUESTED_IP_STEP);
-    write(4, DHCP.our_ip);
-
-    // Set the write pointer back to the start of the message for checksums
-    embed_pointer(placeholder);
-    // Store message length in placeholder
-    placeholder = pointer - placeholder;
-
-    /* Write in IPv4 checksum and packet section lengths */
-    ipv4_header_prep(placeholder);
-
-    /* Write in the link layer footer / checksum */
-    calculate_fcs(placeholder);
-    pointer += 4;
-    placeholder += 4;
+    #ifndef DHCP_UDP
+        /* The link layer footer, the complement of the CRC least significant byte first */
+        fcs = ~fcs;
+        const uint8_t footer[ETH_FOOTER_LEN] = {fcs, fcs >> 8, fcs >> 16, fcs >> 24};
+        write(ADDRESS_OFFSET(message, frame_len), ETH_FOOTER_LEN, footer);
+        frame_len += ETH_FOOTER_LEN;
+    #endif
 
-    DHCP_Socket.tx_pointer = pointer;
+    DHCP_Socket.tx_pointer = pointer + frame_len;
 
     #ifdef DEBUG
-        from_wizchip_to_uart(placeholder);
+        from_wizchip_to_uart(ADDRESS_OFFSET(message, FRAME_HEADERS_LEN), frame_len - FRAME_HEADERS_LEN);
     #endif
 
     socket_send_message(&DHCP_Socket);
 
-    DHCP.dhcp_lease_time = 0;
+    bus_end();
+
+    // Repeats of the same message wait longer each time, a new one starts over
+    if (DHCP.dhcp_status != DHCP.sent_status) {
+        DHCP.sent_status = DHCP.dhcp_status;
+        DHCP.retries = 0;
+    }
+    DHCP.dhcp_timeout = timeout_in(backoff_delay(DHCP.retries));
+    if (DHCP.retries < UINT8_MAX) {
+        DHCP.retries++;
+    }
 }
 
 
 void parse_packet() {
-    // Check where you left off reading
-    set_address(S_RX_RD);
-    uint16_t rx_pointer = get_2_byte();
-
-    // Get the length info from the RX buffer (it's written as two bytes before the actual message)
-    set_address((rx_pointer >> 8), rx_pointer, S_RX_BUF_BLOCK);
-    uint8_t buf[2];
-    read(buf, 2, 2);
-    uint16_t received_amount = (((uint16_t)buf[0] << 8) | buf[1]);
-    // Adjust pointers to account for the two extra bytes taken by the length info
-    received_amount -= 2;
-    rx_pointer += 2;
+    // The whole parse goes out in one bus session
+    bus_begin();
+
+    // Check how much has come in and where you left off reading (S_RX_RSR and S_RX_RD are adjacent)
+    uint16_t rx_registers[2];
+    read_snapshot(SOCKET_ADDRESS(S_RX_RSR, DHCP_Socket.sockno), rx_registers, 2);
+    uint16_t rx_pointer = rx_registers[1];
+
+    #ifdef DHCP_UDP
+        // Get the sender's IP and port and the message length from the RX buffer (written as eight bytes before the message)
+        uint8_t buf[UDP_INFO_LEN];
+        read(RX_ADDRESS(rx_pointer), buf, UDP_INFO_LEN, UDP_INFO_LEN);
+        uint16_t received_amount = (((uint16_t)buf[6] << 8) | buf[7]);
+        rx_pointer += UDP_INFO_LEN;
+    #else
+        // Get the length info from the RX buffer (it's written as two bytes before the actual message)
+        uint8_t buf[2];
+        read(RX_ADDRESS(rx_pointer), buf, 2, 2);
+        uint16_t received_amount = (((uint16_t)buf[0] << 8) | buf[1]);
+        // Adjust pointers to account for the two extra bytes taken by the length info
+        received_amount -= 2;
+        rx_pointer += 2;
+    #endif
 
     #ifdef DEBUG
-        print_buffer(buf, 2, 2);
+        print_buffer(buf, sizeof(buf), sizeof(buf));
         uart_write(".");
     #endif
 
     // Don't let a misaligned pointer trap you in a loop of always reading zero and never moving forward, or to reading massive amounts
     if (received_amount == 0 || received_amount > 0x02FF) {
-        set_address(S_RX_RSR);
-        received_amount = get_2_byte();
         // Update read pointer to mark the buffer as read
-        socket_update_read_pointer(&DHCP_Socket, received_amount);
+        socket_update_read_pointer(&DHCP_Socket, rx_registers[1] + rx_registers[0]);
 
+        bus_end();
         return;
     }
 
     /* Check whether the message looks like it's DHCP and read it if it is */
-    int8_t is_dhcp = check_if_dhcp(rx_pointer, received_amount);
+    // In UDP mode the checks start from where a MACRAW frame would, FRAME_HEADERS_LEN before the message
+    int8_t is_dhcp = check_if_dhcp(rx_pointer - FRAME_HEADERS_LEN, received_amount + FRAME_HEADERS_LEN);
     if (is_dhcp > 0) {
-        read_dhcp_reply(rx_pointer);
+        read_dhcp_reply(rx_pointer - FRAME_HEADERS_LEN);
     }
 
     #ifdef DEBUG
         print_buffer(&is_dhcp, 1, 1);
-        set_address((rx_pointer >> 8), rx_pointer, S_RX_BUF_BLOCK);
-        from_wizchip_to_uart(received_amount);
+        from_wizchip_to_uart(RX_ADDRESS(rx_pointer), received_amount);
     #endif
 
     // Update read pointer to mark the segment as read
     rx_pointer += received_amount;
     socket_update_read_pointer(&DHCP_Socket, rx_pointer);
+
+    bus_end();
 }
 
 int8_t check_if_dhcp(uint16_t read_pointer, uint16_t received_amount) {
-    set_address((read_pointer >> 8), read_pointer, S_RX_BUF_BLOCK);
-
-    // Too short?
-    if (received_amount < 294) {
+    // Too short to have the magic cookie and a message type?
+    if (received_amount < MAGIC_COOKIE_STEP + 4 + 3) {
         return 0;
     }
 
-    uint8_t buffer[6] = {0};
+    // The transaction ID through to the receiver MAC (CHADDR field in DHCP packet) in one read
+    uint8_t buffer[CHADDR_STEP + 6 - XID_STEP];
+    read(RX_ADDRESS(read_pointer + XID_STEP), buffer, sizeof(buffer), sizeof(buffer));
 
-    // If you're in the request stage, only accept an offer from one server
-    if (DHCP.dhcp_status == REQUEST) {
-        embed_pointer(read_pointer + UDP_SOURCE_STEP);
-        read(buffer, 6, 4);
-        if (memcmp(buffer, DHCP.server, 4)) {
-            return -1;
-        }
+    // Only replies to our own messages, not to those of other devices that happen to look like us
+    if (memcmp(buffer, DHCP.xid, 4)) {
+        return -6;
     }
 
-    // Check the receiver MAC (CHADDR field in DHCP packet) to see if the message is directed to you
-    read_pointer += CHADDR_STEP;
-    embed_pointer(read_pointer);
+    // Check the receiver MAC to see if the message is directed to you
     uint8_t comp[6] = {MAC_ADDRESS};
-    read(buffer, 6, 6);
-    print_buffer(buffer, 6, 6);
-    print_buffer(comp, 6, 6);
-    if (memcmp(buffer, comp, 6)) {
+    if (memcmp(buffer + (CHADDR_STEP - XID_STEP), comp, 6)) {
         return -2;
     }
+    memcpy(Reply.our_ip, buffer + (YIADDR_STEP - XID_STEP), 4);
+
+    // Walk the options once, from the magic cookie up to the end of what was received
+    Reply.found = 0;
+    Reply.state = TLV_COOKIE;
+    Reply.pos = 0;
+    read_stream(RX_ADDRESS(read_pointer + MAGIC_COOKIE_STEP), received_amount - MAGIC_COOKIE_STEP, parse_options);
 
-    // Look for the magic cookie
-    ASSIGN(comp, 0, MAGIC_COOKIE);
-    read_pointer += CHADDR_TO_COOKIE_STEP;
-    embed_pointer(read_pointer);
-    read(buffer, 6, 4);
-    if (memcmp(buffer, comp, 4)) {
+    // No magic cookie or message type, not DHCP
+    if (Reply.state == TLV_COOKIE || Reply.state == TLV_BAD_COOKIE || !(Reply.found & _BV(OPT_MESSAGE_TYPE))) {
         return -3;
     }
 
+    // Every offer, ACK and NAK names its server. Once you've picked an offer, only listen to that server,
+    // until rebinding opens the lease up to any server.
+    if (!(Reply.found & _BV(OPT_SERVER))
+            || ((DHCP.dhcp_status == REQUEST || DHCP.dhcp_status == RENEWING) && memcmp(Reply.values[OPT_SERVER], DHCP.server, 4))) {
+        return -1;
+    }
+
     // Message type checks
-    read_pointer += COOKIE_TO_MTYPE_STEP;
-    embed_pointer(read_pointer);
-    read(buffer, 6, 1);
+    uint8_t message_type = Reply.values[OPT_MESSAGE_TYPE][0];
     // If your request is refused, start the discovery process over again
-    if (buffer[0] == PNAK) {
-        DHCP.dhcp_status = DISCOVER;
+    if (message_type == PNAK) {
+        start_discover();
         return -4;
     }
 
     // Make sure the message type is something that would come after what you sent (such as discover being followed by offer)
-    if (!(buffer[0] > (DHCP.dhcp_status & 0x0F))) {
+    if (!(message_type > (DHCP.dhcp_status & 0x0F))) {
         return -5;
     }
 
     return 1;
 }
 
-void read_dhcp_reply(uint16_t read_pointer) {
-    // When the socket is in MACRAW mode, there are extra ethernet layers included to account for.
-    set_address((read_pointer >> 8), read_pointer, S_RX_BUF_BLOCK);
+static void parse_options(const uint8_t *block, uint8_t block_len) {
+    const uint8_t cookie[4] = {MAGIC_COOKIE};
 
-    uint8_t data[6] = {0};
+    for (uint8_t i = 0; i < block_len; i++) {
+        uint8_t byte = block[i];
 
-    /* Take note of the server's address and our offered IP */
-    // The offered IP
-    embed_pointer(read_pointer + YIADDR_STEP);
-    read(data, 4, 4);
-    ASSIGN(DHCP.our_ip, 0, data[0], data[1], data[2], data[3]);
+        switch (Reply.state) {
+            case TLV_COOKIE:
+                if (byte != cookie[Reply.pos]) {
+                    Reply.state = TLV_BAD_COOKIE;
+                }
+                else if (++Reply.pos == 4) {
+                    Reply.state = TLV_CODE;
+                }
+                break;
+            case TLV_CODE:
+                // Padding has no length byte
+                if (byte == OPTION_PAD) {
+                    break;
+                }
+                if (byte == OPTION_END) {
+                    Reply.state = TLV_END;
+                    break;
+                }
+                Reply.slot = option_slot(byte);
+                Reply.state = TLV_LEN;
+                break;
+            case TLV_LEN:
+                Reply.pos = 0;
+                Reply.remaining = byte;
+                Reply.state = (byte) ? TLV_VALUE : TLV_CODE;
+                break;
+            case TLV_VALUE:
+                if (Reply.slot < OPT_SLOTS && Reply.pos < 4) {
+                    Reply.values[Reply.slot][Reply.pos] = byte;
+                }
+                Reply.pos++;
+                // Options cut short by the end of the message never get this far, so they're never counted
+                if (--Reply.remaining == 0) {
+                    if (Reply.slot < OPT_SLOTS && Reply.pos >= ((Reply.slot == OPT_MESSAGE_TYPE) ? 1 : 4)) {
+                        Reply.found |= _BV(Reply.slot);
+                    }
+                    Reply.state = TLV_CODE;
+                }
+                break;
+            default:
+                // Past the end option or a bad cookie, ignore the rest
+                return;
+        }
+    }
+}
+
+static uint8_t option_slot(uint8_t code) {
+    switch (code) {
+        case OPTION_MESSAGE_TYPE: return OPT_MESSAGE_TYPE;
+        case OPTION_SERVER: return OPT_SERVER;
+        case OPTION_SUBNET: return OPT_SUBNET;
+        case OPTION_ROUTER: return OPT_ROUTER;
+        case OPTION_LEASE: return OPT_LEASE;
+        case OPTION_T1: return OPT_T1;
+        case OPTION_T2: return OPT_T2;
+        default: return OPT_SLOTS;
+    }
+}
 
-    // The server doing the offering
-    embed_pointer(read_pointer + SIADDR_STEP);
-    read(data, 4, 4);
-    ASSIGN(DHCP.server, 0, data[0], data[1], data[2], data[3]);
+static uint32_t option_value(uint8_t slot) {
+    if (!(Reply.found & _BV(slot))) {
+        return 0;
+    }
+
+    const uint8_t *value = Reply.values[slot];
+    return ((uint32_t)value[0] << 24) | ((uint32_t)value[1] << 16) | ((uint16_t)value[2] << 8) | value[3];
+}
+
+void read_dhcp_reply(uint16_t read_pointer) {
+    // What the network settings were before, to tell whether a renewal changes them
+    bool renewal = (DHCP.dhcp_status == RENEWING || DHCP.dhcp_status == REBINDING);
+    uint8_t previous[12];
+    memcpy(previous, DHCP.our_ip, 4);
+    memcpy(previous + 4, DHCP.submask, 4);
+    memcpy(previous + 8, DHCP.router, 4);
+
+    /* Take note of the server's address and our offered IP */
+    memcpy(DHCP.our_ip, Reply.our_ip, 4);
+    memcpy(DHCP.server, Reply.values[OPT_SERVER], 4);
 
+    // Take up the offer with a request on the tracker's next pass
     if ((DHCP.dhcp_status & 0x0F) == DISCOVER) {
         DHCP.dhcp_status = REQUEST;
+        DHCP.dhcp_timeout = now_ms();
     }
     /* Assign network info upon a granted request */
     else if ((DHCP.dhcp_status & 0x0F) == REQUEST) {
-        DHCP.dhcp_status = FRESH_ACQUIRED;
-        DHCP.dhcp_lease_time = 0;
+        // Subnet mask and router, if given; without a router the server stands in as the gateway
+        if (Reply.found & _BV(OPT_SUBNET)) {
+            memcpy(DHCP.submask, Reply.values[OPT_SUBNET], 4);
+        }
+        memcpy(DHCP.router, Reply.values[(Reply.found & _BV(OPT_ROUTER)) ? OPT_ROUTER : OPT_SERVER], 4);
+
+        DHCP.lease_time = option_value(OPT_LEASE);
+        DHCP.t1_time = option_value(OPT_T1);
+        DHCP.t2_time = option_value(OPT_T2);
+        set_lease_timeouts();
 
-        // Get subnet mask
-        embed_pointer(read_pointer + MAGIC_COOKIE_STEP + COOKIE_TO_SUBNET_STEP);
-        read(DHCP.submask, 4, 4);
+        #ifndef DHCP_UDP
+            // Renewals are unicast to wherever the ACK came from
+            read(RX_ADDRESS(read_pointer + ETH_SOURCE_STEP), DHCP.server_mac, 6, 6);
+        #else
+            (void)read_pointer;
+        #endif
 
+        // The socket keeps its buffer memory for renewals, handing it to the TCP pool would move every TCP socket's buffers
         socket_close(&DHCP_Socket);
+        save_lease();
 
+        // A renewal of the lease as it was only moves the deadlines, the W5500's settings
+        // and the TCP pool (with whatever connections it is serving) stay as they are
+        if (renewal && !memcmp(previous, DHCP.our_ip, 4) && !memcmp(previous + 4, DHCP.submask, 4)
+                && !memcmp(previous + 8, DHCP.router, 4)) {
+            DHCP.dhcp_status = ACQUIRED;
+            return;
+        }
+
+        // A new lease, or a changed one: main.c sets the TCP pool up again for it
+        DHCP.dhcp_status = FRESH_ACQUIRED;
         set_network();
 
         print_ip();
+
+        #ifdef SPI_STATS
+            print_spi_stats(PSTR("DHCP cycle"));
+        #endif
+    }
+}
+
+static void set_lease_timeouts() {
+    uint32_t lease = (DHCP.lease_time) ? DHCP.lease_time : DEFAULT_LEASE_S;
+    if (lease > LEASE_MAX_S) {
+        lease = LEASE_MAX_S;
+    }
+
+    // The defaults of RFC 2131 (4.4.5) for T1 and T2 are 1/2 and 7/8 of the lease, also used when the server's are out of order
+    uint32_t rebind = DHCP.t2_time;
+    if (!rebind || rebind >= lease) {
+        rebind = lease - lease / 8;
+    }
+    uint32_t renew = DHCP.t1_time;
+    if (!renew || renew >= rebind) {
+        renew = lease / 2;
+    }
+
+    DHCP.dhcp_timeout = timeout_in(renew * 1000);
+    DHCP.rebind_timeout = timeout_in(rebind * 1000);
+    DHCP.lease_expiry = timeout_in(lease * 1000);
+}
+
+static uint32_t retry_in(uint32_t deadline) {
+    // The deadline hasn't passed yet, the tracker checks that first
+    uint32_t wait = (deadline - now_ms()) / 2;
+    return timeout_in((wait < RENEW_RETRY_MIN_MS) ? RENEW_RETRY_MIN_MS : wait);
+}
+
+static void save_lease() {
+    Saved_Lease lease;
+    memcpy(lease.our_ip, DHCP.our_ip, 4);
+    memcpy(lease.server, DHCP.server, 4);
+    memcpy(lease.submask, DHCP.submask, 4);
+    memcpy(lease.router, DHCP.router, 4);
+    lease.check = lease_check(&lease);
+
+    // Renewals of the same lease leave the EEPROM alone
+    eeprom_update_block(&lease, &saved_lease, sizeof(Saved_Lease));
+}
+
+static bool load_lease() {
+    Saved_Lease lease;
+    eeprom_read_block(&lease, &saved_lease, sizeof(Saved_Lease));
+    if (lease.check != lease_check(&lease) || lease.our_ip[0] == 0) {
+        return false;
     }
+
+    memcpy(DHCP.our_ip, lease.our_ip, 4);
+    memcpy(DHCP.server, lease.server, 4);
+    memcpy(DHCP.submask, lease.submask, 4);
+    memcpy(DHCP.router, lease.router, 4);
+    return true;
+}
+
+static uint8_t lease_check(const Saved_Lease *lease) {
+    const uint8_t *bytes = (const uint8_t *)lease;
+    uint8_t sum = 0;
+    for (uint8_t i = 0; i < offsetof(Saved_Lease, check); i++) {
+        sum += bytes[i];
+    }
+    return ~sum;
+}
+
+static uint32_t backoff_delay(uint8_t retries) {
+    uint32_t delay = (retries < RETRY_DOUBLINGS) ? (RETRY_BASE_MS << retries) : RETRY_MAX_MS;
+    return delay - RETRY_JITTER_MS + (uint32_t)random() % (2 * RETRY_JITTER_MS + 1);
+}
+
+static void start_discover() {
+    DHCP.dhcp_status = DISCOVER;
+    DHCP.dhcp_timeout = timeout_in((uint32_t)random() % DISCOVER_JITTER_MS);
 }
 
 void print_ip() {
@@ -368,151 +783,47 @@ void print_ip() {
     uart_write("\r\n");
 }
 
-void from_wizchip_to_uart(uint16_t message_len) {
+void from_wizchip_to_uart(Wiz_Address address, uint16_t message_len) {
     uart_write("...");
 
-    // Take note of the original address
-    uint8_t old_address[3] = {wizchip_address[0], wizchip_address[1], wizchip_address[2]};
-    uint16_t pointer = ((uint16_t)wizchip_address[0] << 8) | wizchip_address[1];
-
-    uint8_t buffer[10] = {0};
-
-    for (uint16_t left = message_len; left > 0;) {
-        embed_pointer(pointer);
-        read(buffer, 10, left);
-        print_buffer(buffer, 10, left);
-        pointer += MIN(10, left);
-        left -= MIN(left, 10);
+    // A block per read, printed once the read is over: the UART may share its pin with the SPI clock,
+    // so it can't run in the middle of a transaction (which rules out a read_stream() sink)
+    uint8_t block[STREAM_BLOCK_LEN];
+    for (uint16_t done = 0; done < message_len; done += STREAM_BLOCK_LEN) {
+        uint8_t block_len = (message_len - done < STREAM_BLOCK_LEN) ? (message_len - done) : STREAM_BLOCK_LEN;
+        read(ADDRESS_OFFSET(address, done), block, STREAM_BLOCK_LEN, block_len);
+        print_buffer(block, block_len, block_len);
     }
 
-    // Revert the original address
-    set_address(old_address[0], old_address[1], old_address[2]);
-
     uart_write("...");
 }
 
-/* Writes length data and IPv4 checksum into the headers */
-void ipv4_header_prep(uint16_t message_len) {
-    // Take note of the original address
-    uint8_t old_address[] = {wizchip_address[0], wizchip_address[1], wizchip_address[2]};
-
-    uint16_t pointer = ((uint16_t)wizchip_address[0] << 8) | wizchip_address[1];
-
-    // Adjust the pointer to account for the ethernet header
-    pointer += ETH_H_LEN;
+#ifndef DHCP_UDP
+/*  Works out the packet lengths and the IPv4 checksum for the headers of a message_len long frame,
+    writing them into fields as the IPv4 length, the checksum and the UDP length, two bytes each */
+void ipv4_header_prep(uint8_t *fields, uint16_t message_len, bool unicast) {
+    // IPv4 packet length
+    uint16_t ipv4_len = message_len - ETH_H_LEN;
+    fields[0] = ipv4_len >> 8;
+    fields[1] = ipv4_len;
 
     // UDP packet length
-    uint8_t data[2] = {((message_len - ETH_H_LEN - IPv4_H_LEN) >> 8), (message_len - ETH_H_LEN - IPv4_H_LEN)};
-    embed_pointer(pointer + UDP_LENGTH_STEP);
-    write(2, data);
-
-    // IPv4 packet length
-    data[0] = (message_len - ETH_H_LEN) >> 8;
-    data[1] = message_len - ETH_H_LEN;
-    embed_pointer(pointer + IPv4_LENGTH_STEP);
-    write(2, data);
+    fields[4] = (message_len - ETH_H_LEN - IPv4_H_LEN) >> 8;
+    fields[5] = message_len - ETH_H_LEN - IPv4_H_LEN;
 
     /* IPv4 header checksum */
-    // Data is read two bytes at a time and those two bytes are added to the sum
-    uint32_t sum = 0;
-    for (uint8_t i = 0; i < (IPv4_H_LEN / 2); i += 2) {
-        embed_pointer(pointer + i);
-        read(data, 2, 2);
-        sum += ((uint16_t)data[0] << 8) + data[1];
-    }
-
-    // The upper half of the sum is added to the lower half until the upper half is empty
-    while ((sum & 0xFFFF0000) > 0) {
-        sum = ((sum & 0xFFFF0000) >> 16) + (sum & 0x0000FFFF);
+    // Only the length differs from the template's precomputed checksum, so it gets patched in
+    // as in RFC 1624 (eqn. 3): HC' = ~(~HC + ~m + m'), the template's length m being 0
+    uint32_t sum = (uint16_t)~ipv4_template_checksum + (uint16_t)~0 + ipv4_len;
+    // Unicasts also change the source from 0.0.0.0 (~m being 0xFFFF for both words) to our address
+    // and the destination from 255.255.255.255 (~m being 0) to the server's
+    if (unicast) {
+        sum += 2 * (uint32_t)(uint16_t)~0 + ADDRESS_WORDS(DHCP.our_ip) + ADDRESS_WORDS(DHCP.server);
     }
+    sum = CHECKSUM_FOLD(CHECKSUM_FOLD(sum));
+    uint16_t checksum = ~sum;
 
-    // The result is complemented
-    sum ^= 0xFFFFFFFF;
-
-    // And finally the checksum is written in
-    data[0] = sum >> 8;
-    data[1] = sum;
-    embed_pointer(pointer + IPv4_CHECKSUM_STEP);
-    write(2, data);
-
-    // Revert the original address
-    set_address(old_address[0], old_address[1], old_address[2]);
+    fields[2] = checksum >> 8;
+    fields[3] = checksum;
 }
-
-
-/* Ethernet uses a CRC-32-calculated frame check sequence for error detection. */
-/* Thank you to vafylec for the guide to CRC-32 */
-void calculate_fcs(uint16_t message_len) {
-    // Take note of the original address
-    uint8_t old_address[] = {wizchip_address[0], wizchip_address[1], wizchip_address[2]};
-
-    uint16_t pointer = ((uint16_t)wizchip_address[0] << 8) | wizchip_address[1];
-    uint8_t window[4] = {0}, message[4] = {0};
-
-    uint16_t step = 0;
-    uint16_t read_len = 0;
-
-    /* Go through the message, regularly XOR'ing with the polynomial */
-    for (uint16_t i = 0; i < (message_len + 4);) {
-        // Fetch next section of the message (4 bytes or whatever's left)
-        step = MIN((message_len + 4) - i, 4);
-        read_len = (((message_len - i) > message_len) ? 0 : (message_len - i));
-        read_len = (read_len > 0xFF ? 0xFF : read_len);
-        embed_pointer(pointer);
-
-        ASSIGN(message, 0, 0, 0, 0, 0);
-        read_reversed(message, 4, read_len);
-
-        // The very first bytes are inverted
-        if (i == 0) {
-            ASSIGN(window, 0, ~message[0], ~message[1], ~message[2], ~message[3]);
-            pointer += step;
-            i += step;
-            continue;
-        }
-
-        pointer += MIN(read_len, step);
-        i += step;
-
-        for (uint8_t j = 0; j < step; j++) {
-            for (uint8_t k = 8; k > 0; k--) {
-                // XOR only when the first bit of the window is a zero
-                if (window[0] & 0x80) {
-                    shuffle_window(window);
-                    window[3] |= EXTRACTBIT(message[j], (k - 1));
-                    xor_window(window);
-                }
-                // Else just move the window along
-                else {
-                    shuffle_window(window);
-                    window[3] |= EXTRACTBIT(message[j], (k - 1));
-                }
-            }
-        }
-    }
-
-    // XOR and reverse the bytes
-    ASSIGN(window, 0, reverse_byte(~window[0]), reverse_byte(~window[1]), reverse_byte(~window[2]), reverse_byte(~window[3]));
-
-    // Write frame check sequence at the end of the header
-    embed_pointer(pointer);
-    write(4, window);
-
-    // Revert the original address
-    set_address(old_address[0], old_address[1], old_address[2]);
-}
-
-void shuffle_window(uint8_t *window) {
-    for (uint8_t i = 0; i < 3; i++) {
-        window[i] <<= 1;
-        window[i] |= EXTRACTBIT(window[i + 1], 7);
-    }
-    window[3] <<= 1;
-}
-
-void xor_window(uint8_t *window) {
-    window[0] ^= 0x04;
-    window[1] ^= 0xC1;
-    window[2] ^= 0x1D;
-    window[3] ^= 0xB7;
-}
\ No newline at end of file
+#endif
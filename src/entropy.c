@@ -0,0 +1,34 @@
+/*
+    Randomness for chips without a generator of their own.
+*/
+
+#include "entropy.h"
+#include "crc32.h"
+
+#if defined(__AVR_ATtiny85__)
+    // The temperature sensor against the internal 1.1 V reference
+    #define ENTROPY_ADMUX (_BV(REFS1) | _BV(MUX3) | _BV(MUX2) | _BV(MUX1) | _BV(MUX0))
+#elif defined(__AVR_ATmega328P__)
+    #define ENTROPY_ADMUX (_BV(REFS1) | _BV(REFS0) | _BV(MUX3))
+#endif
+
+
+/*  Folds ENTROPY_SAMPLES readings of the temperature sensor into the running CRC-32 (see crc32.h) and returns it.
+    Takes about 7 ms and leaves the ADC switched off. */
+uint32_t entropy_gather(uint32_t crc) {
+    ADMUX = ENTROPY_ADMUX;
+    // clk/128 keeps the ADC clock within its 200 kHz at both 8 and 16 MHz.
+    // The reference hasn't settled for the first readings, which only makes them noisier.
+    ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+
+    for (uint8_t i = 0; i < ENTROPY_SAMPLES; i++) {
+        ADCSRA |= _BV(ADSC);
+        while (ADCSRA & _BV(ADSC));
+        // ADCL has to be read first, the reading of ADCH releases the result registers
+        crc = crc32_update(crc, ADCL);
+        crc = crc32_update(crc, ADCH);
+    }
+
+    ADCSRA = 0;
+    return crc;
+}
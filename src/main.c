@@ -1,20 +1,50 @@
 #include <util/delay.h>
+#include <avr/sleep.h>
 #include <stdlib.h>
 #include "w5500.h"
 #include "buzzer.h"
+#include "sched.h"
 #include "index_html.h"
 
-void shuffle_interrupts();
 const unsigned char ok[] PROGMEM = "HTTP/1.1 200 OK\r\n\r\n";
 const unsigned char not_found[] PROGMEM = "HTTP/1.1 404 Not Found\r\n\r\n";
 
 void socket_init();
 void check_interrupts();
-void shuffle_interrupts();
+void respond(Socket *socket, uint16_t len, const char *message, uint8_t operands);
+void take_request_start(const uint8_t *block, uint8_t block_len);
+void idle();
+
+void play_sound_sequence(Timer *timer);
+void network_task();
+bool network_pending();
+bool transfer_pending();
+void dhcp_task();
+void diagnostics_task();
+
+// The main loop's tasks, most urgent first: the sequencer (on the timers) mustn't wait for a burst of requests to be served
+const Task tasks[] PROGMEM = {
+    TASK(timer_service, timer_due, 0, 2),
+    TASK(network_task, network_pending, 0, 20),
+    // Moves queued writes along a slice per run, for as long as any are waiting
+    TASK(transfer_service, transfer_pending, 0, 50),
+    TASK(dhcp_task, nullptr, DHCP_TRACKER_MS, DHCP_TRACKER_MS),
+    TASK(diagnostics_task, nullptr, LINK_POLL_MS, LINK_POLL_MS),
+};
+#define TASK_COUNT (sizeof(tasks) / sizeof(Task))
+// The scheduler's bookkeeping for each of them
+Task_State task_states[TASK_COUNT];
 
 static uint8_t sound_sequence_idx = 0;
 static uint8_t sound_sequence_size = 0;
 static sound_s *sound_sequence = nullptr;
+// Moves the sequence on to its next note
+static Timer note_timer;
+
+// The start of a request, up to the first letters of the path ("GET /link "), the rest is streamed past
+#define REQUEST_START_LEN 10
+static uint8_t request_start[REQUEST_START_LEN];
+static uint8_t request_start_len;
 
 sound_s wow[][2] = {
     {
@@ -35,146 +65,229 @@ sound_s wow[][2] = {
 void set_sound_sequence(uint8_t endpoint) {
     if (endpoint == 3) {
         sound_sequence = nullptr;
-        return;
+    } else {
+        sound_sequence_idx = 0;
+        sound_sequence = wow[endpoint];
+        sound_sequence_size = sizeof(wow[endpoint]) / sizeof(sound_s);
     }
 
-    sound_sequence_idx = 0;
-    sound_sequence = wow[endpoint];
-    sound_sequence_size = sizeof(wow[endpoint]) / sizeof(sound_s);
+    // Picked inside a bus session, which would silence a note started right away when it ends,
+    // so the first note (or the silence) comes from the main loop
+    timer_start(&note_timer, 0, play_sound_sequence);
 }
 
 
-void play_sound_sequence() {
+/* Plays the current note of the sequence, with the timer set to move on to the next one once it's done */
+void play_sound_sequence(Timer *timer) {
     if (sound_sequence == nullptr) {
         stop_sound();
         return;
     }
 
-    if (sound_finished) {
-        if (++sound_sequence_idx == sound_sequence_size) {
-            sound_sequence_idx = 0;
-        }
-
-        sound_finished = false;
-    }
-
     set_sound_frequency(
         sound_sequence[sound_sequence_idx].frequency
     );
 
-    set_sound_duration(
-        sound_sequence[sound_sequence_idx].duration_ms
-    );
-
     play_sound();
+
+    timer_start(timer, sound_sequence[sound_sequence_idx].duration_ms, play_sound_sequence);
+
+    if (++sound_sequence_idx == sound_sequence_size) {
+        sound_sequence_idx = 0;
+    }
 }
 
 
 int main(void) {
     // IP address & other setup
+    uart_init();
     setup_wizchip();
     socket_init();
     initialize_buzzer();
+    set_sleep_mode(SLEEP_MODE_IDLE);
 
     for (;;) {
-        play_sound_sequence();
-
-        // Initialises server socket once an IP has been acquired
-        if (DHCP.dhcp_status == FRESH_ACQUIRED) {
-            socket_init();
+        if (!sched_run(tasks, task_states, TASK_COUNT)) {
+            idle();
         }
-        dhcp_tracker();
-        check_interrupts();
     }
 
     return 0;
 }
 
 void socket_init() {
-    // Opens socket 1 to TCP listening state on port 9999
-    tcp_socket_initialise(9999, (RECV_INT | DISCON_INT));
-    uint8_t err;
-    do {
-        err = tcp_listen();
-    } while (err);
+    // Opens the whole TCP pool to listening state on port 9999, each socket takes one client
+    for (uint8_t i = 0; i < USER_SOCKETNO; i++) {
+        tcp_socket_initialise(&TCP_Sockets[i], 9999, (RECV_INT | DISCON_INT));
+        uint8_t err;
+        do {
+            err = tcp_listen(&TCP_Sockets[i]);
+        } while (err);
+    }
+}
+
+/* Serves the W5500's interrupt events, one per run */
+void network_task() {
+    wizchip_service();
+    check_interrupts();
+}
+
+bool network_pending() {
+    return !wizchip_idle();
+}
+
+bool transfer_pending() {
+    return !transfer_idle();
+}
+
+void dhcp_task() {
+    // Initialises server socket once an IP has been acquired
+    if (DHCP.dhcp_status == FRESH_ACQUIRED) {
+        socket_init();
+    }
+    dhcp_tracker();
+}
+
+void diagnostics_task() {
+    wizchip_link_monitor();
+
+    #ifdef SCHED_STATS
+        // Roughly every 10 s
+        static uint8_t polls = 0;
+        if (++polls == 10000 / LINK_POLL_MS) {
+            polls = 0;
+            print_sched_stats(task_states, TASK_COUNT);
+        }
+    #endif
+}
+
+/*  Sleeps until the next interrupt when no task was due.
+    The W5500's interrupt and the clock tick wake it up,
+    and the periodic tasks and the timers only fall due on a clock tick. */
+void idle() {
+    // Anything that comes in after the checks has to wake the sleep up, not go unnoticed before it
+    cli();
+    if (wizchip_idle() && transfer_idle()) {
+        sleep_enable();
+        // The instruction after sei always runs before any pending interrupt, so nothing slips in between
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+    sei();
 }
 
 void check_interrupts() {
-    // Check the list for a new interrupt
-    if (Wizchip.interrupt_list_index == 0) {
+    // Check the ring for a new interrupt
+    uint8_t interrupt = wizchip_pop_interrupt();
+    if (interrupt == 0) {
         return;
     }
 
-    // Extract the socket number from the list
-    uint8_t interrupt = Wizchip.interrupt_list[0];
+    // Extract the socket number from the event
     uint8_t sockno = interrupt >> 5;
 
-
     // DHCP operations, do not touch
     if (sockno == DHCP_SOCKET) {
         dhcp_interrupt();
-        shuffle_interrupts();
         return;
     }
 
     /* User code below */
 
-    uint8_t buffer[20] = {0};
+    // Each socket of the pool serves its own client
+    Socket *socket = Wizchip.sockets[sockno];
 
-    tcp_read_received(buffer, 20);
-    print_buffer(buffer, 20, 20);
+    // Handle the whole request in one bus session
+    bus_begin();
 
-    if (interrupt & RECV_INT) {
-        uint8_t endpoint = buffer[5] & 7;
+    // The whole request goes by in one transmission, only its start is kept
+    memset(request_start, 0, REQUEST_START_LEN);
+    request_start_len = 0;
+    tcp_stream_received(socket, take_request_start);
+    print_buffer(request_start, REQUEST_START_LEN, request_start_len);
 
-        // Endpoint was a space -> send index_html
-        if (endpoint == 0) {
-            tcp_send(
+    if (interrupt & RECV_INT) {
+        uint8_t endpoint = request_start[5] & 7;
+
+        // Endpoint was "link" -> report the link state (checked before the single letters, as 'l' & 7 is 'd' & 7)
+        if (!memcmp_P(&request_start[5], PSTR("link "), 5)) {
+            const char *link = wizchip_link_text();
+            // The status line is held back for the body, if it doesn't fit there's no sending the body either
+            if (tcp_send(socket, sizeof(ok) - 1, ok, OP_PROGMEM | OP_HOLDBACK)) {
+                tcp_disconnect(socket);
+            } else {
+                respond(socket, strlen_P(link), link, OP_PROGMEM | OP_DISCONNECT);
+            }
+        }
+        // Endpoint was a space -> send index_html in the background, it's too long to hold the bus for
+        else if (endpoint == 0) {
+            respond(
+                socket,
                 sizeof(index_html),
                 index_html,
-                OP_PROGMEM
+                OP_PROGMEM | OP_BACKGROUND | OP_DISCONNECT
             );
         }
         // Endpoint was 'a'-'e'
         else if (endpoint < 5) {
-            tcp_send(
+            respond(
+                socket,
                 sizeof(ok),
                 ok,
-                OP_PROGMEM
+                OP_PROGMEM | OP_DISCONNECT
             );
 
             set_sound_sequence(endpoint - 1);
         }
         // Endpoint was not 'a'-'e'
         else {
-            tcp_send(
+            respond(
+                socket,
                 sizeof(not_found),
                 not_found,
-                OP_PROGMEM
+                OP_PROGMEM | OP_DISCONNECT
             );
         }
-        tcp_disconnect();
+
+        #ifdef SPI_STATS
+            print_spi_stats(PSTR("Request"));
+        #endif
     }
 
     if (interrupt & DISCON_INT) {
         uint8_t err;
         do {
-            err = tcp_listen();
+            err = tcp_listen(socket);
         } while (err);
     }
 
+    bus_end();
+
     /* User code above */
+}
+
+
+/*  Sends a response that ends the connection, and makes sure it does end it:
+    a background send the transfer queue can't take goes out in the foreground instead,
+    and a send that can't go out at all disconnects the client without one. */
+void respond(Socket *socket, uint16_t len, const char *message, uint8_t operands) {
+    uint8_t err = tcp_send(socket, len, message, operands);
 
-    shuffle_interrupts();
+    if (err == 2 && (operands & OP_BACKGROUND)) {
+        err = tcp_send(socket, len, message, operands & ~OP_BACKGROUND);
+    }
+
+    // The disconnect would otherwise have come with the send
+    if (err) {
+        tcp_disconnect(socket);
+    }
 }
 
-void shuffle_interrupts() {
-    cli();
-    // Shuffle everything along down the list
-    for (int i = 0; i < Wizchip.interrupt_list_index; i++) {
-        Wizchip.interrupt_list[i] = Wizchip.interrupt_list[i + 1];
+
+/* tcp_stream_received() sink keeping the first REQUEST_START_LEN bytes of the request */
+void take_request_start(const uint8_t *block, uint8_t block_len) {
+    while (block_len-- && request_start_len < REQUEST_START_LEN) {
+        request_start[request_start_len++] = *block++;
     }
-    Wizchip.interrupt_list[Wizchip.interrupt_list_index] = 0;
-    Wizchip.interrupt_list_index--;
-    sei();
 }
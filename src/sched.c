@@ -0,0 +1,110 @@
+/*
+    A cooperative scheduler for the main loop.
+*/
+
+#include <stdlib.h>
+#include "sched.h"
+#include "uart.h"
+
+
+/* Marks the task as due if its period has come around or it has work pending */
+static void release(const Task *task, Task_State *state, uint32_t now);
+
+
+/*  Runs the most urgent due task in the table (in program memory), if any.
+    Returns false if nothing was due, so the caller can sleep until the next interrupt. */
+bool sched_run(const Task *tasks, Task_State *states, uint8_t task_count) {
+    uint32_t now = now_ms();
+
+    // Every task gets looked at, so that the time a starved one became due is known when it finally runs
+    Task task;
+    Task_State *state = nullptr;
+    for (uint8_t i = 0; i < task_count; i++) {
+        Task entry;
+        memcpy_P(&entry, &tasks[i], sizeof(Task));
+        release(&entry, &states[i], now);
+        if (!state && states[i].waiting) {
+            task = entry;
+            state = &states[i];
+        }
+    }
+
+    if (!state) {
+        return false;
+    }
+
+    state->waiting = false;
+    #ifdef SCHED_STATS
+        if (now - state->released > task.deadline_ms) {
+            state->missed++;
+        }
+    #endif
+
+    task.run();
+
+    #ifdef SCHED_STATS
+        uint16_t run_ms = now_ms() - now;
+        state->runs++;
+        state->total_run_ms += run_ms;
+        if (run_ms > state->max_run_ms) {
+            state->max_run_ms = run_ms;
+        }
+    #endif
+
+    return true;
+}
+
+/* Marks the task as due if its period has come around or it has work pending */
+static void release(const Task *task, Task_State *state, uint32_t now) {
+    if (state->waiting) {
+        return;
+    }
+
+    if (task->period_ms && (int32_t)(now - state->next) >= 0) {
+        #ifdef SCHED_STATS
+            state->released = state->next;
+        #endif
+        state->next += task->period_ms;
+        // Periods that went by entirely are skipped, the late run already counts as missed
+        if ((int32_t)(now - state->next) >= 0) {
+            state->next = now + task->period_ms;
+        }
+        state->waiting = true;
+    } else if (task->pending && task->pending()) {
+        #ifdef SCHED_STATS
+            state->released = now;
+        #endif
+        state->waiting = true;
+    }
+}
+
+#ifdef SCHED_STATS
+/* Prints (and resets) the run counts, run times and missed deadlines of every task in the table over UART */
+void print_sched_stats(Task_State *states, uint8_t task_count) {
+    uint8_t number[11];
+
+    for (uint8_t i = 0; i < task_count; i++) {
+        uart_write_P(PSTR("Task "));
+        utoa(i, number, 10);
+        uart_write(number);
+        uart_write_P(PSTR(": runs "));
+        utoa(states[i].runs, number, 10);
+        uart_write(number);
+        uart_write_P(PSTR(", ms total "));
+        ultoa(states[i].total_run_ms, number, 10);
+        uart_write(number);
+        uart_write_P(PSTR(", max "));
+        utoa(states[i].max_run_ms, number, 10);
+        uart_write(number);
+        uart_write_P(PSTR(", missed "));
+        utoa(states[i].missed, number, 10);
+        uart_write(number);
+        uart_write("\r\n");
+
+        states[i].runs = 0;
+        states[i].missed = 0;
+        states[i].max_run_ms = 0;
+        states[i].total_run_ms = 0;
+    }
+}
+#endif
@@ -1,39 +1,206 @@
 /*
-    Module for bit-banged SPI communication between a W5500 and AVR ATtiny85 (or ATmega328P)
+    Module for SPI communication between a W5500 and AVR ATtiny85 (or ATmega328P),
+    bit-banged or over the device's SPI hardware (see SPI_HARDWARE in spi.h)
 */
 
+#include <stdlib.h>
 #include "spi.h"
 #include "buzzer.h"
+#include "uart.h"
+#include "crc32.h"
 
-uint8_t wizchip_address[3] = {0};
+#ifdef SPI_STATS
+SPI_Counters SPI_Stats;
+#endif
 static volatile uint8_t previous_tccr0b = {};
+#if defined(__AVR_ATtiny85__)
 static volatile uint8_t previous_tccr1 = {};
-static uint8_t sreg = 0;
+#elif defined(__AVR_ATmega328P__)
+// The ATmega328P's buzzer is on Timer2, whose control is split in two
+static volatile uint8_t previous_tccr2a = {};
+static volatile uint8_t previous_tccr2b = {};
+#endif
+// How many bus_begin() calls deep we are
+static volatile uint8_t bus_depth = 0;
+// Chip select is low, a transaction is under way
+static volatile bool frame_open = false;
+// An interrupt closed someone else's frame to run its own, so that one has to send its header again
+static volatile bool frame_preempted = false;
 
 #define LOW(pin) PORTB &= ~_BV(pin)
 #define HIGH(pin) PORTB |= _BV(pin)
 #define WRITEOUTPUT(out) PORTB = (PORTB & ~_BV(MO)) | (out << MO)
 #define READINPUT ((PINB & _BV(MI)) >> MI)
 
-/* Sends header to start off transmission */
-void start_transmission();
+/*  Holds off interrupts and sends the header to start off a transmission.
+    Returns the interrupt state to pass on to slice_break() and end_transmission(). */
+static uint8_t start_transmission(Wiz_Address address);
 /* Sets chip select, clock signal low to end transmission */
-void end_transmission(void);
+static void end_transmission(uint8_t sreg);
+/* Chip select low and the header out */
+static void send_header(Wiz_Address address);
+/* Lets pending interrupts in between two slices, then resumes at address if one of them used the bus */
+static void slice_break(Wiz_Address address, uint8_t sreg);
 /* Feeds a byte into the MOSI line bit by bit */
 void write_byte(uint8_t data);
+/* Reads a byte from the MISO line, MSB first */
+static inline uint8_t read_byte(void);
+
+/* Writes data_len bytes from the given source (SEGMENT_RAM etc.) to the W5500's registers. */
+static void write_stream(Wiz_Address address, uint16_t data_len, const uint8_t *data, uint8_t source);
+/*  Pushes data_len bytes from the given source into an ongoing transmission that's currently at address,
+    folding them into the CRC-32 at crc on the way if it isn't nullptr */
+static void stream_out(Wiz_Address address, uint16_t data_len, const uint8_t *data, uint8_t source, uint8_t sreg, uint32_t *crc);
+
+
+#ifdef SPI_USI
+/*  USI three-wire mode, with the shift register clocked by the USITC strobes themselves.
+    Each write of this to USICR toggles USCK, so 16 of them shift a whole byte through at F_CPU / 2. */
+#define USI_STROBE USICR = _BV(USIWM0) | _BV(USICS1) | _BV(USICLK) | _BV(USITC)
+
+/*  Shifts a byte out of and another into the USI data register.
+    The strobes are unrolled so that a byte costs 16 single-cycle OUTs plus the load and the read,
+    ~18 cycles in total, where the bit-banged write_byte() spends ~35 cycles per bit on the
+    variable shifts of EXTRACTBIT alone (~300 cycles a byte) and the bit-banged read ~120 a byte. */
+static inline uint8_t transfer_byte(uint8_t data) {
+    USIDR = data;
+    USI_STROBE; USI_STROBE; USI_STROBE; USI_STROBE;
+    USI_STROBE; USI_STROBE; USI_STROBE; USI_STROBE;
+    USI_STROBE; USI_STROBE; USI_STROBE; USI_STROBE;
+    USI_STROBE; USI_STROBE; USI_STROBE; USI_STROBE;
+    return USIDR;
+}
+#endif
+
+#ifdef SPI_PERIPHERAL
+/* Starts shifting a byte out, stream_wait() tells when it's done */
+#define stream_load(data) (SPDR = (data))
+/* Waits for the byte in the shift register to finish. Leaves SPIF set, so that the next
+   stream_load() clears it, meaning a wait right after a finished transfer falls straight through. */
+#define stream_wait() while (!(SPSR & _BV(SPIF)))
+#else
+/* The bit-banged and USI transports shift synchronously, so there's nothing to wait for */
+#define stream_load(data) write_byte(data)
+#define stream_wait()
+#endif
 
 
 /*  Reads a 2-byte register value repeatedly until the value matches on two consecutive reads.
     As a 2-byte value has to be read in two pieces, there is a possibility of the value changing mid-read.
     Returns the read value. */
-uint16_t get_2_byte() {
-    uint8_t read1[] = {0, 0}, read2[] = {0, 0};
-    do {
-        read2[0] = read1[0];
-        read2[1] = read1[1];
-        read(read1, 2, 2);
-    } while (read1[0] != read2[0] || read1[1] != read2[1]);
-    return ((uint16_t)read2[0] << 8 | read2[1]);
+uint16_t get_2_byte(Wiz_Address address) {
+    uint16_t value;
+    read_snapshot(address, &value, 1);
+    return value;
+}
+
+/*  Reads count adjacent 2-byte registers from address into values, in one burst confirmed by a second one.
+    Only the registers that changed between the two get re-read, on their own, until two consecutive reads match
+    or SNAPSHOT_RETRIES runs out. Returns the number of transactions it took. */
+uint8_t read_snapshot(Wiz_Address address, uint16_t *values, uint8_t count) {
+    uint8_t first[SNAPSHOT_MAX_REGISTERS * 2], second[SNAPSHOT_MAX_REGISTERS * 2];
+    count = MIN(count, SNAPSHOT_MAX_REGISTERS);
+    read(address, first, sizeof(first), count * 2);
+    read(address, second, sizeof(second), count * 2);
+    uint8_t transactions = 2;
+
+    for (uint8_t i = 0; i < count; i++) {
+        uint16_t previous = ((uint16_t)first[2 * i] << 8) | first[2 * i + 1];
+        uint16_t value = ((uint16_t)second[2 * i] << 8) | second[2 * i + 1];
+
+        // Chase a changing register until it holds still
+        for (uint8_t retry = 0; value != previous && retry < SNAPSHOT_RETRIES; retry++) {
+            read(ADDRESS_OFFSET(address, 2 * i), first, 2, 2);
+            transactions++;
+
+            previous = value;
+            value = ((uint16_t)first[0] << 8) | first[1];
+        }
+
+        values[i] = value;
+    }
+
+    STAT_ADD(snapshots, 1);
+    STAT_ADD(snapshot_transactions, transactions);
+
+    return transactions;
+}
+
+#ifdef SPI_STATS
+/* Prints the counters since the last print over UART under the given progmem label, then resets them */
+void print_spi_stats(const char *label) {
+    uint8_t number[6];
+
+    uart_write_P(label);
+    uart_write_P(PSTR(": SPI transactions "));
+    utoa(SPI_Stats.transactions, number, 10);
+    uart_write(number);
+    uart_write_P(PSTR(", saved "));
+    utoa(SPI_Stats.saved, number, 10);
+    uart_write(number);
+    uart_write_P(PSTR(", snapshots "));
+    utoa(SPI_Stats.snapshots, number, 10);
+    uart_write(number);
+    uart_write_P(PSTR(" in "));
+    utoa(SPI_Stats.snapshot_transactions, number, 10);
+    uart_write(number);
+    uart_write_P(PSTR(", W5500 interrupts "));
+    utoa(SPI_Stats.int_assertions, number, 10);
+    uart_write(number);
+    uart_write_P(PSTR(" for events "));
+    utoa(SPI_Stats.int_events, number, 10);
+    uart_write(number);
+    uart_write("\r\n");
+
+    SPI_Stats = (SPI_Counters){};
+}
+#endif
+
+/*  Claims the SPI bus for a batch of transactions: buzzer paused and pins set up, just once.
+    Transactions inside a session only toggle chip select. Sessions nest, the outermost bus_end() releases the bus.
+    Interrupts stay on, transactions only hold them off around chip select edges and a slice at a time. */
+void bus_begin(void) {
+    // An interrupt taking the bus halfway through the setup would find it claimed but not set up
+    uint8_t sreg = SREG;
+    cli();
+
+    if (bus_depth++ == 0) {
+        // Save PWM timer register states
+        previous_tccr0b = TCCR0B;
+        #if defined(__AVR_ATtiny85__)
+            previous_tccr1 = TCCR1;
+        #elif defined(__AVR_ATmega328P__)
+            previous_tccr2a = TCCR2A;
+            previous_tccr2b = TCCR2B;
+        #endif
+
+        // Stop PWM pin modulation as the PWM pin functions
+        // as an SPI pin on the ATtiny85 (MOSI or the clock).
+        stop_sound();
+
+        spi_init();
+    }
+
+    SREG = sreg;
+}
+
+/* Ends a session started with bus_begin(), restoring the buzzer once the outermost one ends */
+void bus_end(void) {
+    uint8_t sreg = SREG;
+    cli();
+
+    if (--bus_depth == 0) {
+        // Restore previous PWM timer register states
+        TCCR0B = previous_tccr0b;
+        #if defined(__AVR_ATtiny85__)
+            TCCR1 = previous_tccr1;
+        #elif defined(__AVR_ATmega328P__)
+            TCCR2A = previous_tccr2a;
+            TCCR2B = previous_tccr2b;
+        #endif
+    }
+
+    SREG = sreg;
 }
 
 /* Initializes the pins needed for SPI transmissions */
@@ -45,148 +212,302 @@ void spi_init() {
 
     // Pins to 0, except for the select pin, which defaults to 1 as a low-active
     HIGH(SEL);
-    HIGH(CLK);
     LOW(MO);
+    #if defined(SPI_USI)
+        // The USI runs in SPI mode 0, so the clock idles low
+        LOW(CLK);
+    #elif defined(SPI_PERIPHERAL)
+        // Master in SPI mode 0 (the clock idles low) at F_CPU / 2
+        LOW(CLK);
+        SPCR = _BV(SPE) | _BV(MSTR);
+        SPSR = _BV(SPI2X);
+    #else
+        HIGH(CLK);
+    #endif
 }
 
 /*  Reads data from a given address into to given buffer.
     Returns 0 on full read, difference between buffer length and read length if buffer space is insufficient to hold the whole message. */
-void read(uint8_t *buffer, uint8_t buffer_len, uint8_t read_len) {
+void read(Wiz_Address address, uint8_t *buffer, uint8_t buffer_len, uint8_t read_len) {
     // Set read bit in header frame
-    wizchip_address[2] &= ~_BV(2);
+    address.control &= ~_BV(2);
     // Send header
-    start_transmission();
+    uint8_t sreg = start_transmission(address);
 
     // Check read length against available buffer size, cap if necessary
     uint8_t len = MIN(read_len, buffer_len);
 
-    uint8_t byte = 0;
-    for (uint16_t i = 0; i < len; i++) {
-        // Reads MISO line, fills byte bit by bit
-        byte = 0;
-        for (int j = 0; j < 8; j++) {
-            LOW(CLK);
-            byte = (byte << 1) + READINPUT;
-            HIGH(CLK);
+    for (uint8_t i = 0; i < len; i++) {
+        if (i && !(i % SPI_SLICE_LEN)) {
+            slice_break(ADDRESS_OFFSET(address, i), sreg);
         }
-        buffer[i] = byte;
+        buffer[i] = read_byte();
     }
-    end_transmission();
+    end_transmission(sreg);
 }
 
-void read_reversed(uint8_t *buffer, uint8_t buffer_len, uint8_t read_len) {
+void read_reversed(Wiz_Address address, uint8_t *buffer, uint8_t buffer_len, uint8_t read_len) {
     // Set read bit in header frame
-    wizchip_address[2] &= ~_BV(2);
+    address.control &= ~_BV(2);
     // Send header
-    start_transmission();
+    uint8_t sreg = start_transmission(address);
 
     // Check read length against available buffer size, cap if necessary
     uint8_t len = MIN(read_len, buffer_len);
 
-    uint8_t byte = 0;
-    LOW(CLK);
-    for (uint8_t i = 0; i < len; i++) {
-        // Reads MISO line, fills byte bit by bit
-        byte = 0;
-        for (int j = 0; j < 8; j++) {
-            byte |= (READINPUT << j);
-            HIGH(CLK);
-            LOW(CLK);
+    #if defined(SPI_HARDWARE)
+        // The transport only shifts MSB first, so the bytes get flipped afterwards
+        for (uint8_t i = 0; i < len; i++) {
+            if (i && !(i % SPI_SLICE_LEN)) {
+                slice_break(ADDRESS_OFFSET(address, i), sreg);
+            }
+            buffer[i] = reverse_byte(read_byte());
         }
-        buffer[i] = byte;
-    }
-    end_transmission();
+    #else
+        uint8_t byte = 0;
+        LOW(CLK);
+        for (uint8_t i = 0; i < len; i++) {
+            if (i && !(i % SPI_SLICE_LEN)) {
+                slice_break(ADDRESS_OFFSET(address, i), sreg);
+                // A new header leaves the clock high
+                LOW(CLK);
+            }
+            // Reads MISO line, fills byte bit by bit
+            byte = 0;
+            for (int j = 0; j < 8; j++) {
+                byte |= (READINPUT << j);
+                HIGH(CLK);
+                LOW(CLK);
+            }
+            buffer[i] = byte;
+        }
+    #endif
+    end_transmission(sreg);
 }
 
-/* Writes an array to the W5500's registers. */
-void write(uint16_t data_len, const uint8_t *data) {
-    // Set write bit in header frame
-    wizchip_address[2] |= _BV(2);
+/*  Reads read_len bytes from a given address in a single transmission, handing them to sink as they come in.
+    Any length up to a whole 16-bit buffer window can be read without staging it in RAM. */
+void read_stream(Wiz_Address address, uint16_t read_len, Stream_Sink sink) {
+    // Set read bit in header frame
+    address.control &= ~_BV(2);
     // Send header
-    start_transmission();
-
-    // Uses write_byte to push message through the pipeline byte by byte
-    for (uint16_t i = 0; i < data_len; i++) {
-        write_byte(data[i]);
+    uint8_t sreg = start_transmission(address);
+
+    uint8_t block[STREAM_BLOCK_LEN];
+    uint8_t filled = 0;
+    uint16_t done = 0;
+    while (done < read_len) {
+        block[filled++] = read_byte();
+        done++;
+
+        // Pass on full blocks and whatever is left at the end, each block is a slice of its own
+        if (filled == STREAM_BLOCK_LEN || done == read_len) {
+            sink(block, filled);
+            filled = 0;
+            slice_break(ADDRESS_OFFSET(address, done), sreg);
+        }
     }
 
-    end_transmission();
+    end_transmission(sreg);
+}
+
+/* Writes an array to the W5500's registers. */
+void write(Wiz_Address address, uint16_t data_len, const uint8_t *data) {
+    write_stream(address, data_len, data, SEGMENT_RAM);
 }
 
 /* Writes an array stored in progmem to the W5500's registers. */
-void write_P(uint16_t data_len, const uint8_t *data) {
+void write_P(Wiz_Address address, uint16_t data_len, const uint8_t *data) {
+    write_stream(address, data_len, data, SEGMENT_PROGMEM);
+}
+
+/* Writes a single byte repeatedly to the W5500's registers. */
+void write_singular(Wiz_Address address, uint16_t data_len, uint8_t data) {
+    write_stream(address, data_len, &data, SEGMENT_FILL);
+}
+
+/*  Writes a list of segments relative to address, in order.
+    Each segment that starts where the previous one ended continues the same burst,
+    a gap ends the burst and starts a new one at the segment's offset. */
+void write_segments(Wiz_Address address, uint8_t segment_count, const Segment *segments) {
+    write_segments_crc(address, segment_count, segments, nullptr);
+}
+
+/*  Like write_segments(), also folding every byte written into the running CRC-32 at crc (see crc32.h)
+    as it goes out. Bytes in the gaps between segments aren't written, so they aren't folded in either. */
+void write_segments_crc(Wiz_Address address, uint8_t segment_count, const Segment *segments, uint32_t *crc) {
     // Set write bit in header frame
-    wizchip_address[2] |= _BV(2);
-    // Send header
-    start_transmission();
+    address.control |= _BV(2);
+
+    // Offset right after the last byte of the ongoing burst
+    uint16_t next = 0;
+    bool transmitting = false;
+    uint8_t sreg = 0;
+    for (uint8_t i = 0; i < segment_count; i++) {
+        const Segment *segment = &segments[i];
+
+        if (!transmitting || segment->offset != next) {
+            if (transmitting) {
+                stream_wait();
+                end_transmission(sreg);
+            }
+            sreg = start_transmission(ADDRESS_OFFSET(address, segment->offset));
+            transmitting = true;
+        }
 
-    // Uses write_byte to push message through the pipeline byte by byte
-    for (uint16_t i = 0; i < data_len; i++) {
-        write_byte(pgm_read_byte(data + i));
+        stream_out(ADDRESS_OFFSET(address, segment->offset), segment->len,
+            (segment->source == SEGMENT_FILL ? &segment->fill : segment->data), segment->source, sreg, crc);
+        next = segment->offset + segment->len;
     }
 
-    end_transmission();
+    if (transmitting) {
+        stream_wait();
+        end_transmission(sreg);
+    }
 }
 
-/* Writes a single byte repeatedly to the W5500's registers. */
-void write_singular(uint16_t data_len, uint8_t data) {
+/* Writes data_len bytes from the given source (SEGMENT_RAM etc.) to the W5500's registers. */
+static void write_stream(Wiz_Address address, uint16_t data_len, const uint8_t *data, uint8_t source) {
     // Set write bit in header frame
-    wizchip_address[2] |= _BV(2);
+    address.control |= _BV(2);
     // Send header
-    start_transmission();
+    uint8_t sreg = start_transmission(address);
+
+    stream_out(address, data_len, data, source, sreg, nullptr);
+    stream_wait();
 
-    // Uses write_byte to push message through the pipeline byte by byte
+    end_transmission(sreg);
+}
+
+/*  Pushes data_len bytes from the given source into an ongoing transmission that's currently at address,
+    folding them into the CRC-32 at crc on the way if it isn't nullptr */
+static void stream_out(Wiz_Address address, uint16_t data_len, const uint8_t *data, uint8_t source, uint8_t sreg, uint32_t *crc) {
+    // Each byte is fetched (and folded into the CRC) while the previous one is still shifting out of the SPI peripheral,
+    // and only loaded once that one is done. Other transports shift synchronously.
+    uint8_t byte;
+    uint8_t slice = SPI_SLICE_LEN;
     for (uint16_t i = 0; i < data_len; i++) {
-        write_byte(data);
+        if (source == SEGMENT_PROGMEM) {
+            byte = pgm_read_byte(data + i);
+        } else if (source == SEGMENT_RAM) {
+            byte = data[i];
+        } else {
+            byte = *data;
+        }
+        if (crc) {
+            *crc = crc32_update(*crc, byte);
+        }
+        stream_wait();
+        if (!slice--) {
+            slice_break(ADDRESS_OFFSET(address, i), sreg);
+            slice = SPI_SLICE_LEN - 1;
+        }
+        stream_load(byte);
     }
-
-    end_transmission();
 }
 
 
-/* Sends header to start off transmission */
-void start_transmission() {
-    // Don't let a writing operation get interrupted by INT0, as that contains other
-    // reads and writes that would mess with the chip select and message contents
-    sreg = SREG;
-    SREG &= 0x7F;
+/*  Holds off interrupts and sends the header to start off a transmission.
+    Returns the interrupt state to pass on to slice_break() and end_transmission(). */
+static uint8_t start_transmission(Wiz_Address address) {
+    // Set up the bus, unless a session has already done so
+    bus_begin();
 
-    // Save PWM timer register states
-    previous_tccr0b = TCCR0B;
-    previous_tccr1 = TCCR1;
+    uint8_t sreg = SREG;
+    cli();
 
-    // Stop PWM pin modulation as the PWM pin functions
-    // as MOSI.
-    stop_sound();
+    // An interrupt cutting into a transaction between its slices closes it here,
+    // the transaction sends a new header in slice_break() once it gets to continue
+    if (frame_open) {
+        PORTB |= IDLE_HIGH;
+        frame_preempted = true;
+    }
+    frame_open = true;
 
-    spi_init();
+    send_header(address);
+    return sreg;
+}
+
+/* Sets chip select, clock signal low to end transmission */
+static void end_transmission(uint8_t sreg) {
+    #ifdef SPI_USI
+        // Every strobe leaves the USI in three-wire mode, where it holds on to DO (the UART's TX pin too)
+        // and clocks from USCK; let go of both so that PORTB and the UART's own strobes work again
+        USICR = 0;
+    #endif
+    // Chip select high to end transmission,
+    // UART output pin high as it is low active (see IDLE_HIGH in spi.h)
+    PORTB |= IDLE_HIGH;
+    frame_open = false;
+
+    SREG = sreg;
+
+    // Release the bus, unless a session is still holding it
+    bus_end();
+}
+
+/* Chip select low and the header out */
+static void send_header(Wiz_Address address) {
+    STAT_ADD(transactions, 1);
 
     // Chip select low to initiate transmission
     LOW(SEL);
 
     // HEADER:
-    write_byte(wizchip_address[0]);
-    write_byte(wizchip_address[1]);
-    write_byte(wizchip_address[2]);
+    write_byte(address.pointer >> 8);
+    write_byte(address.pointer);
+    write_byte(address.control);
 
     // Header sent, set output pin to low
     LOW(MO);
 }
 
-/* Sets chip select, clock signal low to end transmission */
-void end_transmission() {
-    // Chip select high to end transmission,
-    // clock pin high because it doubles as the UART output, which is low active
-    PORTB |= _BV(SEL) | _BV(CLK);
+/*  Lets pending interrupts in between two slices, if the transaction started with them enabled
+    (interrupt handlers never get interrupted, so their own transactions go through in one piece).
+    If one of them used the bus, the transaction picks back up at address with a new header. */
+static void slice_break(Wiz_Address address, uint8_t sreg) {
+    if (!(sreg & _BV(SREG_I))) {
+        return;
+    }
 
-    // Restore previous PWM timer register states
-    TCCR0B = previous_tccr0b;
-    TCCR1 = previous_tccr1;
+    // The instruction after sei() always runs before any pending interrupt, hence the nop
+    sei();
+    __asm__ __volatile__ ("nop");
+    cli();
 
-    // Re-enable interrupts
-    SREG = sreg;
+    if (frame_preempted) {
+        frame_preempted = false;
+        frame_open = true;
+        send_header(address);
+    }
 }
 
+#if defined(SPI_PERIPHERAL)
+/*  Feeds a byte into the MOSI line through the SPI peripheral.
+    At F_CPU / 2 a byte takes 16 cycles plus the load, against ~300 for the bit-banged write_byte(),
+    and in write_stream() the fetch of the next byte overlaps with the shifting of the current one. */
+void write_byte(uint8_t data) {
+    SPDR = data;
+    while (!(SPSR & _BV(SPIF)));
+}
+
+/* Reads a byte from the MISO line through the SPI peripheral */
+static inline uint8_t read_byte(void) {
+    SPDR = 0;
+    while (!(SPSR & _BV(SPIF)));
+    return SPDR;
+}
+#elif defined(SPI_USI)
+/* Feeds a byte into the MOSI line through the USI */
+void write_byte(uint8_t data) {
+    transfer_byte(data);
+}
+
+/* Reads a byte from the MISO line through the USI */
+static inline uint8_t read_byte(void) {
+    return transfer_byte(0);
+}
+#else
 /* Feeds a byte into the MOSI line bit by bit */
 void write_byte(uint8_t data) {
     for (int i = 7; i >= 0; i--) {
@@ -196,3 +517,15 @@ void write_byte(uint8_t data) {
     }
 }
 
+/* Reads MISO line, fills byte bit by bit */
+static inline uint8_t read_byte(void) {
+    uint8_t byte = 0;
+    for (int j = 0; j < 8; j++) {
+        LOW(CLK);
+        byte = (byte << 1) + READINPUT;
+        HIGH(CLK);
+    }
+    return byte;
+}
+#endif
+
@@ -4,125 +4,209 @@
 
 #include "tcp.h"
 
-Socket TCP_Socket;
+Socket TCP_Sockets[USER_SOCKETNO];
+
+// The one background send each socket can have going at a time, at the socket's index in the pool
+static Transfer tcp_transfers[USER_SOCKETNO] = {[0 ... (USER_SOCKETNO - 1)] = {.done = true}};
+static uint8_t tcp_transfer_operands[USER_SOCKETNO];
+
+static void tcp_transfer_done(Transfer *transfer);
 
 /* Basic setup to get the socket ready for operation. */
-void tcp_socket_initialise(uint16_t portno, uint8_t interrupts) {
-    socket_initialise(&TCP_Socket, TCP_MODE, portno, interrupts);
+void tcp_socket_initialise(Socket *socket, uint16_t portno, uint8_t interrupts) {
+    socket_initialise(socket, TCP_MODE, portno, interrupts);
 }
 
 /*  Puts the socket into TCP listen mode.
     If the socket setup doesn't proceed as expected, returns the status code of the socket. */
-uint8_t tcp_listen() {
-    socket_open(&TCP_Socket);
+uint8_t tcp_listen(Socket *socket) {
+    // A background send still going belongs to the previous connection, which the client already dropped.
+    // Whatever is left of it gets dropped too, and it mustn't send or disconnect on the new one.
+    uint8_t index = socket - TCP_Sockets;
+    if (!tcp_transfers[index].done) {
+        tcp_transfer_operands[index] = OP_HOLDBACK;
+        transfer_cancel(&tcp_transfers[index]);
+    }
+
+    // The whole setup goes out in one bus session
+    bus_begin();
+
+    socket_open(socket);
 
     // Ensure that the socket is ready to take a listen command
     uint8_t status = 0;
-    uint8_t killswitch = 0;
-    set_half_address(S_SR_B);
+    uint32_t timeout = timeout_in(TCP_STATUS_TIMEOUT_MS);
     do {
-        read(&status, 1, 1);
-        killswitch++;
-        if (killswitch > 100) {
+        read(SOCKET_ADDRESS(S_SR, socket->sockno), &status, 1, 1);
+        if (timeout_expired(timeout)) {
+            bus_end();
             return status;
         }
     } while (status != SOCK_INIT);
 
     // Get the socket listening
-    set_half_address(S_CR_B);
     uint8_t command = LISTEN;
-    write(1, &command);
+    write(SOCKET_ADDRESS(S_CR, socket->sockno), 1, &command);
 
     // Make sure the socket is in fact listening
-    killswitch = 0;
-    set_half_address(S_SR_B);
+    timeout = timeout_in(TCP_STATUS_TIMEOUT_MS);
     do {
-        read(&status, 1, 1);
-        killswitch++;
-        if (killswitch > 100) {
+        read(SOCKET_ADDRESS(S_SR, socket->sockno), &status, 1, 1);
+        if (timeout_expired(timeout)) {
+            bus_end();
             return status;
         }
     // SOCK_ESTABLISHED included in case there's been an immediate connection
     } while (status != SOCK_LISTEN && status != SOCK_ESTABLISHED);
 
     // Enable interrupts for the socket
-    socket_toggle_interrupts(&TCP_Socket, ON);
+    socket_toggle_interrupts(socket, ON);
 
+    bus_end();
     return 0;
 }
 
 /*  Writes a message to the socket's TX buffer and sends in the "send" command.
     Operands:
     - OP_PROGMEM if you're sending in a pointer to an array in program memory rather than a normal array
-    - OP_HOLDBACK if you want to delay sending the message and write more into the buffer */
-uint8_t tcp_send(uint16_t message_len, const char *message, uint8_t operands) {
+    - OP_HOLDBACK if you want to delay sending the message and write more into the buffer
+    - OP_BACKGROUND to hand the write to the transfer queue and return straight away, the send
+    command goes out once the last byte is written. The message must stay put until then.
+    - OP_DISCONNECT to disconnect once the message has been sent
+    Returns 1 if the buffer doesn't have room, 2 if a background send is still under way. */
+uint8_t tcp_send(Socket *socket, uint16_t message_len, const char *message, uint8_t operands) {
+    // Anything written now would land in the middle of the queued message
+    Transfer *transfer = &tcp_transfers[socket - TCP_Sockets];
+    if (!transfer->done) {
+        return 2;
+    }
+
+    // The space check, the write and the send command go out in one bus session
+    bus_begin();
+
     // Check space left in the buffer (shouldn't run out but you never know)
-    set_address(S_TX_FSR);
-    embed_socket(1);
-    uint16_t send_amount = get_2_byte();
+    uint16_t send_amount;
+    read_snapshot(SOCKET_ADDRESS(S_TX_FSR, socket->sockno), &send_amount, 1);
     if (send_amount < message_len) {
+        bus_end();
         return 1;
     }
 
     // Start writing from the place you left off
-    set_address((TCP_Socket.tx_pointer >> 8), TCP_Socket.tx_pointer, S_TX_BUF_BLOCK);
-    embed_socket(1);
+    Wiz_Address address = BUFFER_ADDRESS(socket->tx_pointer, S_TX_BUF_BLOCK, socket->sockno);
+
+    // Leave the writing and the sending to the transfer queue
+    if (operands & OP_BACKGROUND) {
+        transfer->address = address;
+        transfer->len = message_len;
+        transfer->source = (operands & OP_PROGMEM) ? SEGMENT_PROGMEM : SEGMENT_RAM;
+        transfer->data = message;
+        transfer->on_done = tcp_transfer_done;
+        tcp_transfer_operands[socket - TCP_Sockets] = operands;
+
+        uint8_t err = transfer_queue(transfer) ? 0 : 2;
+        if (!err) {
+            socket->tx_pointer += message_len;
+        }
+
+        bus_end();
+        return err;
+    }
 
     // Write message to buffer
     if (operands & OP_PROGMEM) {
-        write_P(message_len, message);
+        write_P(address, message_len, message);
     } else {
-        write(message_len, message);
+        write(address, message_len, message);
     }
 
     // Increment write pointer
-    TCP_Socket.tx_pointer += message_len;
+    socket->tx_pointer += message_len;
 
     // Don't send the message yet if HOLDBACK is active
-    if (operands & OP_HOLDBACK) {
-        return 0;
+    if (!(operands & OP_HOLDBACK)) {
+        socket_send_message(socket);
     }
 
-    socket_send_message(&TCP_Socket);
+    if (operands & OP_DISCONNECT) {
+        tcp_disconnect(socket);
+    }
 
+    bus_end();
     return 0;
 }
 
+/* Finishes a background send once the transfer queue has written all of it. */
+static void tcp_transfer_done(Transfer *transfer) {
+    uint8_t index = transfer - tcp_transfers;
+    Socket *socket = &TCP_Sockets[index];
+
+    if (!(tcp_transfer_operands[index] & OP_HOLDBACK)) {
+        socket_send_message(socket);
+    }
+
+    if (tcp_transfer_operands[index] & OP_DISCONNECT) {
+        tcp_disconnect(socket);
+    }
+}
+
 /*  Reads the socket's RX buffer into a given buffer
     - As the only goal for our server is to get the path from a message, the message is
     marked as entirely received even when only a small amount is in fact read */
-void tcp_read_received(uint8_t *buffer, uint8_t buffer_len) {
-    // Check how much has come in and where you left off reading
-    set_address(S_RX_RSR);
-    embed_socket(1);
-    uint16_t received_amount = get_2_byte();
-    set_half_address(S_RX_RD_B);
-    uint16_t rx_pointer = get_2_byte();
+void tcp_read_received(Socket *socket, uint8_t *buffer, uint8_t buffer_len) {
+    // The pointer checks, the read and the pointer update go out in one bus session
+    bus_begin();
+
+    // Check how much has come in and where you left off reading (S_RX_RSR and S_RX_RD are adjacent)
+    uint16_t rx_registers[2];
+    read_snapshot(SOCKET_ADDRESS(S_RX_RSR, socket->sockno), rx_registers, 2);
+    uint16_t received_amount = rx_registers[0];
+    uint16_t rx_pointer = rx_registers[1];
 
     uint16_t read_amount = MIN(buffer_len, received_amount);
 
     // Read incoming into the buffer
-    set_address((rx_pointer >> 8), rx_pointer, S_RX_BUF_BLOCK);
-    embed_socket(1);
+    read(BUFFER_ADDRESS(rx_pointer, S_RX_BUF_BLOCK, socket->sockno), buffer, buffer_len, read_amount);
+
+    rx_pointer += received_amount;
+
+    // Update the read pointer
+    socket_update_read_pointer(socket, rx_pointer);
+
+    bus_end();
+}
+
+/*  Streams everything in the socket's RX buffer to sink in one transmission, then marks it as read.
+    Returns the number of bytes streamed. */
+uint16_t tcp_stream_received(Socket *socket, Stream_Sink sink) {
+    // The pointer checks, the read and the pointer update go out in one bus session
+    bus_begin();
 
-    read(buffer, buffer_len, read_amount);
+    // Check how much has come in and where you left off reading (S_RX_RSR and S_RX_RD are adjacent)
+    uint16_t rx_registers[2];
+    read_snapshot(SOCKET_ADDRESS(S_RX_RSR, socket->sockno), rx_registers, 2);
+    uint16_t received_amount = rx_registers[0];
+    uint16_t rx_pointer = rx_registers[1];
+
+    // Stream the whole lot, the W5500 wraps the address around the end of the buffer by itself
+    read_stream(BUFFER_ADDRESS(rx_pointer, S_RX_BUF_BLOCK, socket->sockno), received_amount, sink);
 
     rx_pointer += received_amount;
 
     // Update the read pointer
-    socket_update_read_pointer(&TCP_Socket, rx_pointer);
+    socket_update_read_pointer(socket, rx_pointer);
+
+    bus_end();
+    return received_amount;
 }
 
 /* Sends a disconnect command to the socket, which will start a connection close process. */
-void tcp_disconnect() {
-    set_address(S_CR);
-    embed_socket(1);
-
+void tcp_disconnect(Socket *socket) {
     uint8_t discon = DISCON;
-    write(1, &discon);
+    write(SOCKET_ADDRESS(S_CR, socket->sockno), 1, &discon);
 }
 
 /* Closes the socket. */
-void tcp_close() {
-    socket_close(&TCP_Socket);
+void tcp_close(Socket *socket) {
+    socket_close(socket);
 }
\ No newline at end of file
@@ -0,0 +1,79 @@
+/*
+    Background transfer queue for the W5500.
+*/
+
+#include "transfer.h"
+
+#define QUEUE_MASK (TRANSFER_QUEUE_LEN - 1)
+
+// Written by transfer_queue only
+static uint8_t queue_head = 0;
+// Written by transfer_service only
+static uint8_t queue_tail = 0;
+static Transfer *queue[TRANSFER_QUEUE_LEN];
+
+
+/*  Puts a transfer at the end of the queue.
+    Returns false if the queue is full. */
+bool transfer_queue(Transfer *transfer) {
+    uint8_t head = queue_head;
+    if ((uint8_t)(head - queue_tail) == TRANSFER_QUEUE_LEN) {
+        return false;
+    }
+
+    transfer->progress = 0;
+    transfer->done = false;
+    queue[head & QUEUE_MASK] = transfer;
+
+    // Publish only once the slot is filled in
+    queue_head = head + 1;
+    return true;
+}
+
+/* Writes the next slice of the transfer at the front of the queue, if any. */
+void transfer_service() {
+    // Skip the bus session entirely when there's nothing to do
+    if (transfer_idle()) {
+        return;
+    }
+
+    bus_begin();
+
+    Transfer *transfer = queue[queue_tail & QUEUE_MASK];
+    Wiz_Address address = ADDRESS_OFFSET(transfer->address, transfer->progress);
+
+    uint16_t slice_len = MIN(TRANSFER_SLICE_LEN, transfer->len - transfer->progress);
+    const uint8_t *slice = (const uint8_t *)transfer->data + transfer->progress;
+    if (slice_len == 0) {
+        // Cancelled, nothing left to write
+    } else if (transfer->source == SEGMENT_PROGMEM) {
+        write_P(address, slice_len, slice);
+    } else {
+        write(address, slice_len, slice);
+    }
+    transfer->progress += slice_len;
+
+    if (transfer->progress == transfer->len) {
+        queue_tail++;
+        transfer->done = true;
+        if (transfer->on_done) {
+            transfer->on_done(transfer);
+        }
+    }
+
+    bus_end();
+}
+
+/*  Cuts a queued transfer short, dropping whatever hasn't been written yet.
+    It still leaves the queue the usual way, done set and on_done called. */
+void transfer_cancel(Transfer *transfer) {
+    // Slices are only written from the main loop, so progress stays put while this runs
+    if (!transfer->done) {
+        transfer->len = transfer->progress;
+    }
+}
+
+/* True when nothing is waiting in the queue. */
+bool transfer_idle() {
+    return queue_head == queue_tail;
+}
@@ -5,6 +5,13 @@ void uart_init() {
     SET_UART_PIN;
     // Idle high (UART inactive state).
     SET_UART_INACTIVE;
+
+    #if defined(__AVR_ATmega328P__)
+        // 8 data bits, no parity, one stop bit
+        UBRR0 = F_CPU / 16 / UART_BAUD_RATE - 1;
+        UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+        UCSR0B = _BV(TXEN0);
+    #endif
 }
 
 
@@ -20,11 +27,17 @@ uint8_t reverse_byte(uint8_t x) {
 }
 
 
+#if defined(__AVR_ATmega328P__)
+void uart_putchar(char byte) {
+    // The USART keeps the timing, so interrupts can stay on
+    while (!(UCSR0A & _BV(UDRE0)));
+    UDR0 = byte;
+}
+#else
 void uart_putchar(char byte) {
-    // Define baud rate and signal duration
+    // Define signal duration
     // in microseconds for each bit.
-    constexpr uint16_t baud_rate = 9600;
-    constexpr uint8_t bit_delay_us = 1'000'000 / baud_rate;
+    constexpr uint8_t bit_delay_us = 1'000'000 / UART_BAUD_RATE;
 
     // Disable interrupts to maintain UART timing.
     uint8_t interrupts = SREG;
@@ -70,6 +83,7 @@ void uart_putchar(char byte) {
     // Re-enable interrupts.
     SREG |= interrupts;
 }
+#endif
 
 
 void uart_write(const char *data) {
@@ -88,15 +102,6 @@ void uart_write_P(const char* data) {
 }
 
 
-#ifndef __AVR_ATtiny85__
-void print_buffer(const uint8_t *buffer, uint8_t buffer_len, uint16_t print_len) {
-    
-}
-void print_buffer_P(const uint8_t *buffer, uint8_t buffer_len, uint16_t print_len) {
-
-}
-#endif
-#ifdef __AVR_ATtiny85__
 void print_buffer(const uint8_t *buffer, uint8_t buffer_len, uint16_t print_len) {
     uint8_t len = (print_len <= buffer_len ? print_len : buffer_len);
     uint8_t byte;
@@ -112,4 +117,3 @@ void print_buffer_P(const uint8_t *buffer, uint8_t buffer_len, uint16_t print_le
         uart_putchar(pgm_read_byte(buffer + i));
     }
 }
-#endif
\ No newline at end of file
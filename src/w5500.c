@@ -7,34 +7,61 @@
 
 // The module provides a single W5500 instance to the user
 W5500 Wizchip;
+// Set by the ISR when the W5500 raises its interrupt line, cleared by wizchip_service()
+static volatile bool interrupt_pending = false;
+
+// Buffer sizes in KB as last written to each socket's S_RXBUF_SIZE and S_TXBUF_SIZE (2 KB each after reset)
+static uint8_t buffer_sizes[W5500_SOCKETS] = {[0 ... (W5500_SOCKETS - 1)] = 2};
+
+/* Reads and clears the interrupt registers of the alerting sockets, adding the interrupts to the ring */
+static void sweep_interrupts(void);
+/* Closes a TCP socket and puts it back to listening */
+static void relisten(Socket *socket);
+/* Works out power-of-two buffer sizes in KB for each socket from their weights (0 for unused) */
+static void plan_buffers(uint8_t *sizes, const uint8_t *weights);
+/* Adds an interrupt event to the ring, merging it into a waiting one for the same socket if there is one */
+static void push_interrupt(uint8_t interrupt);
 
 /* Device initialization */
 void setup_wizchip(void) {
-    Wizchip.interrupt_list_index = 0;
+    Wizchip.interrupt_head = 0;
+    Wizchip.interrupt_tail = 0;
+    Wizchip.interrupt_overflows = 0;
+
+    // Set up the link as configured in PHY_MODE
+    // Feed in the new config and "use these bits for configuration" setting, holding the PHY in reset
+    uint8_t command = _BV(OPMD) | (PHY_MODE << OPMDC);
+    write(ADDRESS(PHYCFGR), 1, &command);
+    // Apply config by letting the PHY out of reset, keeping the config bits as they are
+    command |= _BV(RST);
+    write(ADDRESS(PHYCFGR), 1, &command);
+    // Unknown until wizchip_link_monitor() gets to it
+    Wizchip.link = 0;
+
+    // Hold new interrupts back for INT_WAIT_US, so that a burst of events is swept up in one go
+    const uint8_t intlevel[] = {(uint8_t)(INTLEVEL_VALUE >> 8), (uint8_t)INTLEVEL_VALUE};
+    write(ADDRESS(INTLEVEL), 2, intlevel);
+
+    // Clears the socket interrupt mask on the W5500 (before the DHCP client enables its own)
+    socket_clear_interrupt_mask();
+
+    // Nothing is open yet, so the buffer memory can be split up freely
+    wizchip_plan_buffers();
 
     DHCP_Socket.sockno = 0;
     Wizchip.sockets[0] = &DHCP_Socket;
     dhcp_setup();
 
-    TCP_Socket.sockno = 1;
-    Wizchip.sockets[1] = &TCP_Socket;
-
-    // Set up the link as a 10M half-duplex connection
-    // Feed in the new config and "use these bits for configuration" setting
-    set_address(PHYCFGR);
-    uint8_t command = _BV(OPMD) | (PHY_HD10BTNN << OPMDC);
-    write(1, &command);
-    // Apply config
-    command = _BV(RST);
-    write(1, &command);
-
-    // Clears the socket interrupt mask on the W5500
-    set_half_address(SIMR_B);
-    command = 0;
-    write(1, &command);
+    // The TCP pool takes up the rest
+    for (uint8_t i = 0; i < USER_SOCKETNO; i++) {
+        TCP_Sockets[i].sockno = TCP_FIRST_SOCKET + i;
+        Wizchip.sockets[TCP_FIRST_SOCKET + i] = &TCP_Sockets[i];
+    }
 
     // Enable interrupts on the microcontroller
     setup_atthing_interrupts();
+    // The tick behind now_ms(), the timers and the link poll
+    clock_init();
 
     #ifdef DEBUG
         uart_write_P(PSTR("Setup complete.\r\n"));
@@ -45,24 +72,224 @@ void setup_wizchip(void) {
 void setup_atthing_interrupts(void) {
     cli();
 
-    // Set INT0 to trogger on low
-    INT_MODE = (INT_MODE & ~(_BV(ISC00) | _BV(ISC01)));
-    // Enable INT0
-    INT_ENABLE |= _BV(INT0);
+    #ifdef INT_PIN_CHANGE
+        // Watch the interrupt pin for changes, the ISR ignores the rising edges
+        PCMSK |= _BV(INTR);
+    #else
+        // Set INT0 to trogger on low
+        INT_MODE = (INT_MODE & ~(_BV(ISC00) | _BV(ISC01)));
+    #endif
+    // Enable INT0 (or the pin change interrupt)
+    INT_ENABLE |= _BV(INT_BIT);
 
     // Enable interrupts in general in the status register
     sei();
 }
 
-ISR(INT0_vect) {
-    // Take note of the original address
-    uint8_t old_pointer[] = {wizchip_address[0], wizchip_address[1], wizchip_address[2]};
+/*  Splits the W5500's buffer memory between the DHCP socket and the TCP pool by their weights.
+    The plan is fixed, setup_wizchip() applies it before anything opens. Should it ever change, sockets whose
+    buffers resize or move (every socket after the first one that resizes) are closed for it: the DHCP socket
+    is left for the DHCP client to reopen, listening TCP sockets are closed and put back to listening
+    (dropping any connection they had). Does nothing if the plan is already in place. */
+void wizchip_plan_buffers(void) {
+    uint8_t weights[W5500_SOCKETS] = {0};
+    uint8_t sizes[W5500_SOCKETS];
+
+    weights[DHCP_SOCKET] = DHCP_BUFFER_WEIGHT;
+    for (uint8_t i = 0; i < USER_SOCKETNO; i++) {
+        weights[TCP_FIRST_SOCKET + i] = TCP_BUFFER_WEIGHT;
+    }
+    plan_buffers(sizes, weights);
+
+    bus_begin();
+
+    // The W5500 lays the buffers out one after another from socket 0, so a socket whose size changes
+    // moves the buffers of every socket after it, whether or not their own size changes
+    bool moved = false;
+    for (uint8_t i = 0; i < W5500_SOCKETS; i++) {
+        if (sizes[i] != buffer_sizes[i]) {
+            moved = true;
+        }
+        if (!moved) {
+            continue;
+        }
+
+        // Only sockets of ours can be open, and the buffers can't move under an open one
+        Socket *socket = (i < SOCKETNO) ? Wizchip.sockets[i] : nullptr;
+        bool listener = socket && i != DHCP_SOCKET && socket->mode == TCP_MODE && (socket->shadowed & SHADOW_MR);
+        if (socket && (socket->shadowed & SHADOW_MR)) {
+            socket_close(socket);
+        }
+
+        // S_RXBUF_SIZE and S_TXBUF_SIZE are adjacent, both get the same size
+        if (sizes[i] != buffer_sizes[i]) {
+            uint8_t size[] = {sizes[i], sizes[i]};
+            write(SOCKET_ADDRESS(S_RXBUF_SIZE, i), 2, size);
+            buffer_sizes[i] = sizes[i];
+        }
+
+        if (listener) {
+            relisten(socket);
+        }
+    }
+
+    bus_end();
+}
+
+/* Works out power-of-two buffer sizes in KB for each socket from their weights (0 for unused) */
+static void plan_buffers(uint8_t *sizes, const uint8_t *weights) {
+    uint8_t total_weight = 0;
+    for (uint8_t i = 0; i < W5500_SOCKETS; i++) {
+        total_weight += weights[i];
+    }
+
+    // Everyone in use starts off with the largest power of two that fits their share, at least 1 KB
+    uint8_t used = 0;
+    for (uint8_t i = 0; i < W5500_SOCKETS; i++) {
+        sizes[i] = 0;
+        if (weights[i] == 0) {
+            continue;
+        }
+
+        uint8_t share = (BUFFER_MEMORY_KB * weights[i]) / total_weight;
+        sizes[i] = 1;
+        while ((sizes[i] << 1) <= share) {
+            sizes[i] <<= 1;
+        }
+        used += sizes[i];
+    }
+
+    // Rounding down leaves some over, which goes to whoever is furthest below their weight,
+    // doubling one socket at a time for as long as it fits
+    for (;;) {
+        uint8_t pick = W5500_SOCKETS;
+        for (uint8_t i = 0; i < W5500_SOCKETS; i++) {
+            if (weights[i] == 0 || used + sizes[i] > BUFFER_MEMORY_KB) {
+                continue;
+            }
+            // Compare weight per KB without dividing
+            if (pick == W5500_SOCKETS || weights[i] * sizes[pick] > weights[pick] * sizes[i]) {
+                pick = i;
+            }
+        }
+        if (pick == W5500_SOCKETS) {
+            break;
+        }
+        used += sizes[pick];
+        sizes[pick] <<= 1;
+    }
+}
+
+/* Closes a TCP socket and puts it back to listening */
+static void relisten(Socket *socket) {
+    socket_close(socket);
+
+    uint8_t err;
+    do {
+        err = tcp_listen(socket);
+    } while (err);
+}
+
+/*  Reads the PHY's link state and reports changes over UART, to be called every LINK_POLL_MS or so.
+    When the link comes up, the DHCP client starts over and the TCP sockets go back to listening. */
+void wizchip_link_monitor(void) {
+    uint8_t phy = 0;
+    read(ADDRESS(PHYCFGR), &phy, 1, 1);
+    // Speed and duplex mean nothing without a link
+    uint8_t link = (phy & _BV(LNK)) ? (phy & (_BV(LNK) | _BV(SPD) | _BV(DPX))) : 0;
+    if (link == Wizchip.link) {
+        return;
+    }
+    bool came_up = (link & _BV(LNK)) && !(Wizchip.link & _BV(LNK));
+    Wizchip.link = link;
+
+    uart_write_P(PSTR("Link "));
+    uart_write_P(wizchip_link_text());
+    uart_write_P(PSTR("\r\n"));
+
+    if (!came_up) {
+        return;
+    }
+
+    // Whatever was going on before is gone, and the network may not even be the same one.
+    // This also covers the first DHCP message at startup (the INIT-REBOOT request or the discover), which goes out before the link is up.
+    bus_begin();
+
+    dhcp_setup();
+    for (uint8_t i = 0; i < USER_SOCKETNO; i++) {
+        if (TCP_Sockets[i].mode == TCP_MODE && (TCP_Sockets[i].shadowed & SHADOW_MR)) {
+            relisten(&TCP_Sockets[i]);
+        }
+    }
+
+    bus_end();
+}
+
+/* The link state as of the last poll as a progmem string, such as "up, 100M full-duplex" */
+const char *wizchip_link_text(void) {
+    if (!(Wizchip.link & _BV(LNK))) {
+        return PSTR("down");
+    }
+
+    switch (Wizchip.link & (_BV(SPD) | _BV(DPX))) {
+        case _BV(SPD) | _BV(DPX):
+            return PSTR("up, 100M full-duplex");
+        case _BV(SPD):
+            return PSTR("up, 100M half-duplex");
+        case _BV(DPX):
+            return PSTR("up, 10M full-duplex");
+        default:
+            return PSTR("up, 10M half-duplex");
+    }
+}
+
+/*  Top half of the W5500 interrupt: only flags it for wizchip_service(), so that the SPI sweep
+    runs in the main loop instead of holding off every other interrupt for its whole length. */
+ISR(W5500_INT_vect) {
+    #ifdef INT_PIN_CHANGE
+        // A pin change fires on both edges, only the falling one means anything
+        if (INT_ASSERTED) {
+            interrupt_pending = true;
+        }
+    #else
+        // INT0 is level-triggered and would fire again straight away, so it stays off until the sweep is done
+        DISABLEINT0;
+        interrupt_pending = true;
+    #endif
+}
+
+/*  Bottom half of the W5500 interrupt, polled from the main loop: drains the interrupt registers
+    into the ring in one bus session, if the ISR has flagged anything. */
+void wizchip_service(void) {
+    if (!interrupt_pending) {
+        return;
+    }
+    // Cleared before the sweep, so an edge during it gets another pass
+    interrupt_pending = false;
+
+    bus_begin();
+    STAT_ADD(int_assertions, 1);
 
+    // Keep sweeping until the W5500 lets go of the line, picking up whatever came in during the last pass.
+    // Each sweep covers every socket, including events still held back by INTLEVEL.
+    while (INT_ASSERTED) {
+        sweep_interrupts();
+    }
+
+    bus_end();
+
+    #ifndef INT_PIN_CHANGE
+        // Anything newer pulls the line back low and fires INT0 again
+        ENABLEINT0;
+    #endif
+}
+
+/* Reads and clears the interrupt registers of the alerting sockets, adding the interrupts to the ring */
+static void sweep_interrupts(void) {
     uint8_t sockets = 0, interrupts = 0;
 
     // Fetch interrupt register to check which socket is alerting
-    set_address(SIR);
-    read(&sockets, 1, 1);
+    read(ADDRESS(SIR), &sockets, 1, 1);
     // Test for each socket
     for (uint8_t i = 0; i < SOCKETNO; i++) {
         if (EXTRACTBIT(sockets, i) == 0) {
@@ -71,39 +298,80 @@ ISR(INT0_vect) {
 
         // Get the socket's interrupt register to see what's going on
         interrupts = 0;
-        set_address(S_IR);
-        embed_socket(i);
-        read(&interrupts, 1, 1);
+        read(SOCKET_ADDRESS(S_IR, i), &interrupts, 1, 1);
 
         // Write 1s to the interrupts to clear them
-        write(1, &interrupts);
+        write(SOCKET_ADDRESS(S_IR, i), 1, &interrupts);
 
         // TCP sockets' tx buffer pointers are initialized on connection, so an update is necessary
         if (Wizchip.sockets[i]->mode == TCP_MODE && (interrupts & CON_INT)) {
-            set_half_address(S_TX_RD_B);
-            Wizchip.sockets[i]->tx_pointer = get_2_byte();
+            Wizchip.sockets[i]->tx_pointer = get_2_byte(SOCKET_ADDRESS(S_TX_RD, i));
         }
 
         // The interrupt mask is used to set which interrupts are active,
         // so the mask can be used to filter out any extras that shouldn't cause an alert
         interrupts &= Wizchip.sockets[i]->interrupts;
 
-        // If there's an interrupt, add it to the list
+        // If there's an interrupt, add it to the ring
         if (interrupts == 0) {
             continue;
         }
 
-        // Make sure you don't go out of bounds with the list size
-        if (Wizchip.interrupt_list_index >= (INTERRUPT_LIST_SIZE - 1)) {
-            continue;
+        // Embed the socket number into the three unused bits of the interrupt byte
+        push_interrupt((i << 5) | interrupts);
+        STAT_ADD(int_events, 1);
+    }
+}
+
+/* Adds an interrupt event to the ring, merging it into a waiting one for the same socket if there is one */
+static void push_interrupt(uint8_t interrupt) {
+    uint8_t head = Wizchip.interrupt_head;
+    uint8_t tail = Wizchip.interrupt_tail;
+
+    // Only the waiting events, from the tail up to the head. Popping happens in the main loop too,
+    // never halfway through this, so the one at the tail can take a merge as well.
+    for (uint8_t i = tail; i != head; i++) {
+        uint8_t *event = (uint8_t *)&Wizchip.interrupt_ring[i & INTERRUPT_RING_MASK];
+        if ((*event >> 5) == (interrupt >> 5)) {
+            *event |= interrupt;
+            return;
         }
+    }
 
-        // Embed the socket number into the three unused bits of the interrupt byte
-        Wizchip.interrupt_list[Wizchip.interrupt_list_index] = (i << 5) | interrupts;
-        Wizchip.interrupt_list_index++;
+    if ((uint8_t)(head - tail) == INTERRUPT_RING_SIZE) {
+        Wizchip.interrupt_overflows++;
+        return;
     }
 
-    set_address(old_pointer[0], old_pointer[1], old_pointer[2]);
+    Wizchip.interrupt_ring[head & INTERRUPT_RING_MASK] = interrupt;
+    // Publish only once the slot is filled in
+    Wizchip.interrupt_head = head + 1;
+}
+
+/*  True when the W5500 has nothing waiting: no interrupt flagged for wizchip_service() and an empty ring.
+    Call with interrupts off to have it stay that way until sleeping. */
+bool wizchip_idle(void) {
+    return !interrupt_pending && Wizchip.interrupt_head == Wizchip.interrupt_tail;
+}
+
+/*  Takes the oldest interrupt event off the ring.
+    Returns 0 if there are none, otherwise the interrupt bits with the socket number in the top three bits. */
+uint8_t wizchip_pop_interrupt(void) {
+    uint8_t tail = Wizchip.interrupt_tail;
+    if (tail == Wizchip.interrupt_head) {
+        return 0;
+    }
+
+    uint8_t interrupt = Wizchip.interrupt_ring[tail & INTERRUPT_RING_MASK];
+    // Hands the slot back to wizchip_service()
+    Wizchip.interrupt_tail = tail + 1;
+    return interrupt;
+}
+
+/* The number of interrupt events dropped so far because the ring was full */
+uint16_t wizchip_interrupt_overflows(void) {
+    // Only wizchip_service() counts them, in the main loop, so the two bytes can't change halfway through the read
+    return Wizchip.interrupt_overflows;
 }
 
 
@@ -0,0 +1,11 @@
+/* Host stand-ins for avr-libc's EEPROM access, declared but never defined */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EEMEM
+
+void eeprom_read_block(void *destination, const void *source, size_t len);
+void eeprom_update_block(const void *source, void *destination, size_t len);
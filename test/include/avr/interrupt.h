@@ -0,0 +1,9 @@
+/* Host stand-ins for avr-libc's interrupt handling */
+
+#pragma once
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+#define cli()
+#define sei()
@@ -0,0 +1,27 @@
+/*
+    Host stand-ins for the ATtiny85's registers, so that the firmware's headers compile for the tests.
+    Nothing the tests link may touch them, they're declared but never defined.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+extern volatile uint8_t PORTB, DDRB, PINB, MCUCR, GIMSK, GIFR, PCMSK, SREG;
+extern volatile uint8_t USIDR, USICR, USISR;
+extern volatile uint8_t TCCR0A, TCCR0B, OCR0A, TIMSK, TCCR1, OCR1A, OCR1C;
+extern volatile uint8_t WDTCR, ADMUX, ADCSRA, ADCL, ADCH;
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+
+#define SREG_I 7
+#define INT0 6
+#define ISC00 0
+#define ISC01 1
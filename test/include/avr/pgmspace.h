@@ -0,0 +1,17 @@
+/* Host stand-ins for avr-libc's progmem access: there's only the one address space */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define pgm_read_dword(address) (*(const uint32_t *)(address))
+
+#define memcpy_P memcpy
+#define memcmp_P memcmp
+#define strlen_P strlen
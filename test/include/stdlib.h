@@ -0,0 +1,10 @@
+/* The host's stdlib.h, with the avr-libc functions strict C23 leaves out declared on top */
+
+#pragma once
+
+#include_next <stdlib.h>
+
+char *utoa(unsigned int value, char *string, int radix);
+char *ultoa(unsigned long value, char *string, int radix);
+long random(void);
+void srandom(unsigned int seed);
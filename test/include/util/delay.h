@@ -0,0 +1,6 @@
+/* Host stand-ins for avr-libc's busy waits */
+
+#pragma once
+
+#define _delay_us(us)
+#define _delay_ms(ms)
@@ -0,0 +1,24 @@
+/*
+    A minimal harness for the host tests: CHECK() reports a failed condition and carries on,
+    TEST_RESULT() ends main() with the number of failures.
+*/
+
+#pragma once
+
+#include <stdio.h>
+
+static int test_failures = 0;
+
+#define CHECK(condition, ...) do { \
+    if (!(condition)) { \
+        test_failures++; \
+        printf("%s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+    } \
+} while (0)
+
+#define TEST_RESULT() do { \
+    printf("%s: %s\n", __FILE__, test_failures ? "FAILED" : "ok"); \
+    return test_failures != 0; \
+} while (0)
@@ -0,0 +1,59 @@
+/*
+    The nibble-table CRC-32 (crc32_update) against a bit-at-a-time reference.
+*/
+
+#include "../src/crc32.c"
+#include "test.h"
+
+
+/* The reflected CRC-32 the slow way, one bit of the byte at a time */
+static uint32_t reference_update(uint32_t crc, uint8_t byte) {
+    crc ^= byte;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320ul : 0);
+    }
+    return crc;
+}
+
+static uint32_t crc32_of(const uint8_t *data, uint16_t len) {
+    uint32_t crc = CRC32_INIT;
+    for (uint16_t i = 0; i < len; i++) {
+        crc = crc32_update(crc, data[i]);
+    }
+    return ~crc;
+}
+
+
+int main(void) {
+    // The standard check value
+    const uint8_t check[] = "123456789";
+    uint32_t crc = crc32_of(check, sizeof(check) - 1);
+    CHECK(crc == 0xCBF43926ul, "CRC-32 of \"123456789\" is 0x%08lX", (unsigned long)crc);
+
+    // Every byte from every running value the table's nibbles can meet
+    for (uint16_t byte = 0; byte < 256; byte++) {
+        const uint32_t starts[] = {CRC32_INIT, 0, 0x12345678ul, 0x80000001ul};
+        for (uint8_t i = 0; i < sizeof(starts) / sizeof(starts[0]); i++) {
+            uint32_t expected = reference_update(starts[i], byte);
+            uint32_t got = crc32_update(starts[i], byte);
+            CHECK(got == expected, "byte 0x%02X from 0x%08lX gives 0x%08lX, expected 0x%08lX",
+                byte, (unsigned long)starts[i], (unsigned long)got, (unsigned long)expected);
+        }
+    }
+
+    // A frame followed by its frame check sequence, least significant byte first, leaves the Ethernet residue
+    uint8_t frame[64 + 4];
+    uint32_t seed = 1;
+    for (uint8_t i = 0; i < 64; i++) {
+        seed = seed * 1103515245ul + 12345;
+        frame[i] = seed >> 16;
+    }
+    uint32_t fcs = crc32_of(frame, 64);
+    for (uint8_t i = 0; i < 4; i++) {
+        frame[64 + i] = fcs >> (8 * i);
+    }
+    uint32_t residue = ~crc32_of(frame, sizeof(frame));
+    CHECK(residue == 0xDEBB20E3ul, "frame with its FCS leaves 0x%08lX", (unsigned long)residue);
+
+    TEST_RESULT();
+}
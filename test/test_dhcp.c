@@ -0,0 +1,73 @@
+/*
+    The IPv4 header checksum of the DHCP client's MACRAW frames (ipv4_header_prep, ipv4_template_checksum).
+*/
+
+#include "../src/dhcp.c"
+#include "test.h"
+
+
+/*  Lays out the IPv4 header of a message_len long frame the way the frame segments do:
+    the template from macraw_frame with the fields from ipv4_header_prep spliced in,
+    and for unicasts our address and the server's over the template's */
+static void build_header(uint8_t *header, uint16_t message_len, bool unicast) {
+    uint8_t fields[6];
+    ipv4_header_prep(fields, message_len, unicast);
+
+    memcpy(header, macraw_frame + ETH_H_LEN, IPv4_H_LEN);
+    memcpy(header + IPv4_LENGTH_STEP, fields, 2);
+    memcpy(header + IPv4_CHECKSUM_STEP, fields + 2, 2);
+    if (unicast) {
+        memcpy(header + IPv4_SOURCE_STEP, DHCP.our_ip, 4);
+        memcpy(header + IPv4_DEST_STEP, DHCP.server, 4);
+    }
+}
+
+/* The one's complement sum of the header's words, 0xFFFF for a header with the right checksum */
+static uint16_t header_sum(const uint8_t *header) {
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i < IPv4_H_LEN; i += 2) {
+        sum += (header[i] << 8) | header[i + 1];
+    }
+    sum = CHECKSUM_FOLD(CHECKSUM_FOLD(sum));
+    return sum;
+}
+
+static void check_frame(uint16_t message_len, bool unicast) {
+    uint8_t header[IPv4_H_LEN];
+    build_header(header, message_len, unicast);
+
+    uint16_t sum = header_sum(header);
+    CHECK(sum == 0xFFFF, "%s frame of %u bytes: header sums to 0x%04X",
+        unicast ? "unicast" : "broadcast", message_len, sum);
+
+    uint16_t ipv4_len = (header[IPv4_LENGTH_STEP] << 8) | header[IPv4_LENGTH_STEP + 1];
+    CHECK(ipv4_len == message_len - ETH_H_LEN, "frame of %u bytes: IPv4 length %u", message_len, ipv4_len);
+}
+
+
+int main(void) {
+    // The frame lengths the client sends, and a few more around carries in the sum
+    const uint16_t lengths[] = {DHCP_TOTAL_LEN, MACRAW_H_LEN, 300, 342, 590, 1514, 0xFFFF};
+
+    // Broadcasts from 0.0.0.0 to 255.255.255.255
+    for (uint8_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        check_frame(lengths[i], false);
+    }
+
+    // Unicasts from our address to the server's, with high and low bytes for the carries
+    const uint8_t addresses[][2][4] = {
+        {{192, 168, 1, 100}, {192, 168, 1, 1}},
+        {{10, 0, 0, 2}, {10, 0, 0, 1}},
+        {{255, 255, 255, 254}, {255, 255, 255, 253}},
+        {{0, 0, 0, 1}, {255, 255, 0, 0}},
+    };
+    for (uint8_t a = 0; a < sizeof(addresses) / sizeof(addresses[0]); a++) {
+        memcpy(DHCP.our_ip, addresses[a][0], 4);
+        memcpy(DHCP.server, addresses[a][1], 4);
+        for (uint8_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+            check_frame(lengths[i], true);
+        }
+    }
+
+    TEST_RESULT();
+}
@@ -0,0 +1,105 @@
+/*
+    The interrupt event ring (push_interrupt, wizchip_pop_interrupt).
+*/
+
+#include "../src/w5500.c"
+#include "test.h"
+
+
+#define EVENT(socket, interrupts) (((socket) << 5) | (interrupts))
+
+static uint8_t waiting(void) {
+    return Wizchip.interrupt_head - Wizchip.interrupt_tail;
+}
+
+/* Empties the ring, leaving it at the given position with stale events from earlier rounds in every slot */
+static void reset_ring(uint8_t position) {
+    for (uint8_t i = 0; i < INTERRUPT_RING_SIZE; i++) {
+        Wizchip.interrupt_ring[i] = EVENT(i, RECV_INT);
+    }
+    Wizchip.interrupt_head = position;
+    Wizchip.interrupt_tail = position;
+    Wizchip.interrupt_overflows = 0;
+}
+
+
+/* Every event pushed on an empty ring comes back out, whatever the stale slots say */
+static void check_empty(uint8_t position) {
+    for (uint8_t socket = 0; socket < SOCKETNO; socket++) {
+        reset_ring(position);
+        push_interrupt(EVENT(socket, DISCON_INT));
+        CHECK(waiting() == 1, "empty ring at %u: %u waiting after a push for socket %u", position, waiting(), socket);
+
+        uint8_t event = wizchip_pop_interrupt();
+        CHECK(event == EVENT(socket, DISCON_INT), "empty ring at %u: popped 0x%02X for socket %u", position, event, socket);
+        CHECK(wizchip_pop_interrupt() == 0, "empty ring at %u: a second pop found something", position);
+    }
+}
+
+/* Events for a socket already waiting merge into its entry, others queue up behind it in order */
+static void check_partly_full(uint8_t position) {
+    reset_ring(position);
+    push_interrupt(EVENT(1, CON_INT));
+    push_interrupt(EVENT(0, RECV_INT));
+    push_interrupt(EVENT(1, RECV_INT));
+    push_interrupt(EVENT(2, RECV_INT));
+    push_interrupt(EVENT(1, DISCON_INT));
+    CHECK(waiting() == 3, "ring at %u: %u waiting, expected 3", position, waiting());
+
+    const uint8_t expected[] = {EVENT(1, CON_INT | RECV_INT | DISCON_INT), EVENT(0, RECV_INT), EVENT(2, RECV_INT)};
+    for (uint8_t i = 0; i < sizeof(expected); i++) {
+        uint8_t event = wizchip_pop_interrupt();
+        CHECK(event == expected[i], "ring at %u: pop %u gave 0x%02X, expected 0x%02X", position, i, event, expected[i]);
+    }
+    CHECK(wizchip_pop_interrupt() == 0, "ring at %u: something left over", position);
+    CHECK(Wizchip.interrupt_overflows == 0, "ring at %u: %u overflows", position, Wizchip.interrupt_overflows);
+}
+
+/* A full ring holds one event per socket number, so anything more merges, the oldest one included */
+static void check_full(uint8_t position) {
+    reset_ring(position);
+    for (uint8_t socket = 0; socket < INTERRUPT_RING_SIZE; socket++) {
+        push_interrupt(EVENT(socket, RECV_INT));
+    }
+    CHECK(waiting() == INTERRUPT_RING_SIZE, "full ring at %u: %u waiting", position, waiting());
+
+    for (uint8_t socket = 0; socket < INTERRUPT_RING_SIZE; socket++) {
+        push_interrupt(EVENT(socket, DISCON_INT));
+    }
+    CHECK(waiting() == INTERRUPT_RING_SIZE, "full ring at %u: %u waiting after merges", position, waiting());
+    CHECK(Wizchip.interrupt_overflows == 0, "full ring at %u: %u overflows", position, Wizchip.interrupt_overflows);
+
+    for (uint8_t socket = 0; socket < INTERRUPT_RING_SIZE; socket++) {
+        uint8_t event = wizchip_pop_interrupt();
+        CHECK(event == EVENT(socket, RECV_INT | DISCON_INT), "full ring at %u: popped 0x%02X for socket %u",
+            position, event, socket);
+    }
+    CHECK(wizchip_pop_interrupt() == 0, "full ring at %u: something left over", position);
+}
+
+/* A ring that somehow holds the same socket twice has no room for a new one, which gets counted as dropped */
+static void check_overflow(uint8_t position) {
+    reset_ring(position);
+    for (uint8_t i = 0; i < INTERRUPT_RING_SIZE; i++) {
+        Wizchip.interrupt_ring[(position + i) & INTERRUPT_RING_MASK] = EVENT(i / 2, RECV_INT);
+    }
+    Wizchip.interrupt_head = position + INTERRUPT_RING_SIZE;
+
+    push_interrupt(EVENT(7, RECV_INT));
+    CHECK(Wizchip.interrupt_overflows == 1, "overfull ring at %u: %u overflows", position, Wizchip.interrupt_overflows);
+    CHECK(waiting() == INTERRUPT_RING_SIZE, "overfull ring at %u: %u waiting", position, waiting());
+}
+
+
+int main(void) {
+    // From the start, from the middle and across the wrap of the 8-bit positions
+    const uint8_t positions[] = {0, 5, 250, 255};
+    for (uint8_t i = 0; i < sizeof(positions); i++) {
+        check_empty(positions[i]);
+        check_partly_full(positions[i]);
+        check_full(positions[i]);
+        check_overflow(positions[i]);
+    }
+
+    TEST_RESULT();
+}